@@ -50,7 +50,50 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define BT_SERV_HSP             "00001108"
 #define BT_SERV_HFP             "0000111E"
 
-#define BT_PULSE_RETRIES    50
+/* Flags for the audio services a BlueZ device offers */
+
+#define BT_SERVICE_AUDIO_SOURCE 0x01
+#define BT_SERVICE_AUDIO_SINK   0x02
+#define BT_SERVICE_HSP          0x04
+#define BT_SERVICE_HFP          0x08
+
+#define BT_PULSE_TIMEOUT    10  /* Seconds to wait for PulseAudio to publish a connected device */
+
+/* States of the connection to a device after BlueZ has connected it */
+
+#define BT_CONN_IDLE        0
+#define BT_CONN_WAIT_CARD   1
+#define BT_CONN_SET_PROFILE 2
+#define BT_CONN_WAIT_DEVICE 3
+#define BT_CONN_SET_DEFAULT 4
+
+/* Connection to a BlueZ device in progress */
+
+typedef struct
+{
+    VolumePulsePlugin *vol;             /* Plugin the connection belongs to */
+    guint id;                           /* Serial number - passed to PulseAudio operations */
+    char *path;                         /* BlueZ object path of the device */
+    gboolean input;                     /* Connecting as input rather than output */
+    int state;                          /* State after BlueZ has connected the device */
+    const char *profile;                /* Card profile requested for the device */
+    guint timer;                        /* Timeout for PulseAudio publishing the device */
+    GCancellable *cancellable;          /* Cancels D-Bus calls when the connection ends */
+} BluetoothConnection;
+
+/* Flags to show which device counts a BlueZ device is included in */
+
+#define BT_COUNT_OUTPUT     0x01
+#define BT_COUNT_INPUT      0x02
+
+/* BlueZ device - only counted if paired and trusted, with an audio service */
+
+typedef struct
+{
+    char *alias;                        /* Device name shown to the user */
+    guint services;                     /* Audio services offered, from the UUIDs */
+    guint counts;                       /* Directions the device is counted in */
+} BluetoothDevice;
 
 /*----------------------------------------------------------------------------*/
 /* Global data                                                                */
@@ -60,46 +103,42 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /* Prototypes                                                                 */
 /*----------------------------------------------------------------------------*/
 
-static char *bt_to_pa_name (const char *bluez_name, char *type, char *profile);
 static void bt_cb_name_owned (GDBusConnection *connection, const gchar *name, const gchar *owner, gpointer user_data);
 static void bt_cb_name_unowned (GDBusConnection *connection, const gchar *name, gpointer user_data);
+static void bt_cb_object_added (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data);
 static void bt_cb_object_removed (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data);
 static void bt_cb_interface_properties (GDBusObjectManagerClient *manager, GDBusObjectProxy *object_proxy, GDBusProxy *proxy, GVariant *parameters, GStrv inval, gpointer user_data);
-static void bt_connect_device (VolumePulsePlugin *vol, const char *device);
-static void bt_cb_connected (GObject *source, GAsyncResult *res, gpointer user_data);
-static gboolean bt_conn_set_profile (gpointer user_data);
-static gboolean bt_conn_set_sink_source (gpointer user_data);
+static void bt_connect_device (VolumePulsePlugin *vol, const char *device, gboolean input);
+static BluetoothConnection *bt_conn_new (VolumePulsePlugin *vol, const char *path, gboolean input);
 static void bt_cb_trusted (GObject *source, GAsyncResult *res, gpointer user_data);
-static gboolean bt_has_service (VolumePulsePlugin *vol, const gchar *path, const gchar *service);
+static void bt_cb_connected (GObject *source, GAsyncResult *res, gpointer user_data);
+static void bt_conn_wait_card (BluetoothConnection *conn);
+static void bt_conn_set_profile (BluetoothConnection *conn);
+static void bt_cb_profile_set (VolumePulsePlugin *vol, gboolean success, gpointer data);
+static void bt_conn_set_sink_source (BluetoothConnection *conn);
+static void bt_cb_sink_source_set (VolumePulsePlugin *vol, gboolean success, gpointer data);
+static gboolean bt_conn_timeout (gpointer user_data);
+static BluetoothConnection *bt_conn_find (VolumePulsePlugin *vol, guint id);
+static void bt_conn_finish (BluetoothConnection *conn, const char *msg);
+static void bt_conn_free (BluetoothConnection *conn);
+static guint bt_read_services (GDBusInterface *interface);
+static BluetoothDevice *bt_read_device (VolumePulsePlugin *vol, const gchar *path, BluetoothDevice *old);
+static void bt_device_free (gpointer data);
+static guint bt_update_device (VolumePulsePlugin *vol, const gchar *path, gboolean services_changed);
+static guint bt_remove_device (VolumePulsePlugin *vol, const gchar *path);
+static void bt_update_visibility (VolumePulsePlugin *vol, guint counts);
+static guint bt_read_all_devices (VolumePulsePlugin *vol);
+static void bt_clear_devices (VolumePulsePlugin *vol);
 static void bt_connect_dialog_show (VolumePulsePlugin *vol, const char *fmt, ...);
 static void bt_connect_dialog_update (VolumePulsePlugin *vol, const char *msg);
 static void bt_connect_dialog_ok (GtkButton *button, VolumePulsePlugin *vol);
 static gboolean bt_is_connected (VolumePulsePlugin *vol, const char *path);
+static void bt_cb_output_set (VolumePulsePlugin *vol, gboolean success, gpointer data);
 
 /*----------------------------------------------------------------------------*/
 /* Function definitions                                                       */
 /*----------------------------------------------------------------------------*/
 
-/*----------------------------------------------------------------------------*/
-/* Bluetooth name remapping                                                   */
-/*----------------------------------------------------------------------------*/
-
-/* Convert the BlueZ name of a device to a PulseAudio sink / source / card */
-
-static char *bt_to_pa_name (const char *bluez_name, char *type, char *profile)
-{
-    unsigned int b1, b2, b3, b4, b5, b6;
-
-    if (bluez_name == NULL) return NULL;
-    if (sscanf (bluez_name, "/org/bluez/hci0/dev_%x_%x_%x_%x_%x_%x", &b1, &b2, &b3, &b4, &b5, &b6) != 6)
-    {
-        DEBUG ("Bluez name invalid : %s", bluez_name);
-        return NULL;
-    }
-    return g_strdup_printf ("bluez_%s.%02X_%02X_%02X_%02X_%02X_%02X%s%s",
-        type, b1, b2, b3, b4, b5, b6, profile ? "." : "", profile ? profile : "");
-}
-
 /*----------------------------------------------------------------------------*/
 /* Bluetooth D-Bus interface                                                  */
 /*----------------------------------------------------------------------------*/
@@ -119,7 +158,19 @@ static void bt_cb_name_owned (GDBusConnection *, const gchar *name, const gchar
         DEBUG ("Error getting object manager - %s", error->message);
         vol->bt_objmanager = NULL;
         g_error_free (error);
+        return;
     }
+
+    /* Track devices being added, removed and changed, and read those already present */
+    g_signal_connect (vol->bt_objmanager, "object-added", G_CALLBACK (bt_cb_object_added), vol);
+    g_signal_connect (vol->bt_objmanager, "object-removed", G_CALLBACK (bt_cb_object_removed), vol);
+    g_signal_connect (vol->bt_objmanager, "interface-proxy-properties-changed", G_CALLBACK (bt_cb_interface_properties), vol);
+
+    /* BlueZ may appear after the display and menus were set up from PulseAudio alone */
+    bt_update_visibility (vol, bt_read_all_devices (vol));
+
+    /* Prebuilt menus which are now stale are built again in the background, rather than on first opening */
+    if (vol->menu_stale[0] || vol->menu_stale[1]) menu_prefetch (vol);
 }
 
 /* Callback for BlueZ disappearing on D-Bus */
@@ -127,15 +178,32 @@ static void bt_cb_name_owned (GDBusConnection *, const gchar *name, const gchar
 static void bt_cb_name_unowned (GDBusConnection *, const gchar *name, gpointer user_data)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+    guint counts;
     DEBUG ("Name %s unowned on D-Bus", name);
 
     if (vol->bt_objmanager)
     {
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_object_added), vol);
         g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_object_removed), vol);
         g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_interface_properties), vol);
         g_object_unref (vol->bt_objmanager);
     }
     vol->bt_objmanager = NULL;
+
+    /* Any devices which were known have gone */
+    counts = (vol->bt_count[0] ? BT_COUNT_OUTPUT : 0) | (vol->bt_count[1] ? BT_COUNT_INPUT : 0);
+    bt_clear_devices (vol);
+    bt_update_visibility (vol, counts);
+}
+
+/* Callback for BlueZ device being added */
+
+static void bt_cb_object_added (GDBusObjectManager *, GDBusObject *object, gpointer user_data)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+
+    DEBUG ("Bluetooth object %s added", g_dbus_object_get_object_path (object));
+    bt_update_visibility (vol, bt_update_device (vol, g_dbus_object_get_object_path (object), TRUE));
 }
 
 /* Callback for BlueZ device disconnecting */
@@ -145,230 +213,479 @@ static void bt_cb_object_removed (GDBusObjectManager *, GDBusObject *object, gpo
     VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
 
     DEBUG ("Bluetooth object %s removed", g_dbus_object_get_object_path (object));
-    volumepulse_update_display (vol);
+    bt_update_visibility (vol, bt_remove_device (vol, g_dbus_object_get_object_path (object)));
 }
 
-/* Callback for BlueZ device property change - used to detect connection */
+/* Callback for BlueZ device property change - used to detect pairing and trusting */
 
-static void bt_cb_interface_properties (GDBusObjectManagerClient *, GDBusObjectProxy *, GDBusProxy *proxy, GVariant *parameters, GStrv, gpointer user_data)
+static void bt_cb_interface_properties (GDBusObjectManagerClient *, GDBusObjectProxy *, GDBusProxy *proxy, GVariant *parameters, GStrv inval, gpointer user_data)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
-    GVariant *var;
+    GVariant *uuids;
+    gboolean services_changed;
 
+    if (g_strcmp0 (g_dbus_proxy_get_interface_name (proxy), "org.bluez.Device1")) return;
     DEBUG ("Bluetooth object %s property change", g_dbus_proxy_get_object_path (proxy));
 
-    var = g_variant_lookup_value (parameters, "Trusted", NULL);
-    if (var)
-    {
-        if (g_variant_get_boolean (var) == TRUE)
-        {
-            volumepulse_update_display (vol);
-        }
-        g_variant_unref (var);
-    }
-}
+    // the services are only parsed again if the UUIDs have changed
+    uuids = g_variant_lookup_value (parameters, "UUIDs", NULL);
+    services_changed = uuids || (inval && g_strv_contains ((const gchar * const *) inval, "UUIDs"));
+    if (uuids) g_variant_unref (uuids);
 
-/* Connect a BlueZ device */
+    bt_update_visibility (vol, bt_update_device (vol, g_dbus_proxy_get_object_path (proxy), services_changed));
+}
 
-static void bt_connect_device (VolumePulsePlugin *vol, const char *device)
+/*
+ * Each device being connected has its own connection record, so that several
+ * devices can be connected at once. D-Bus calls for a connection are passed the
+ * record, and are cancelled when it ends; PulseAudio operations are passed its
+ * serial number, so that a completion for a connection which has ended is ignored.
+ *
+ * Once a device has connected, the rest of the connection is driven by the local
+ * PulseAudio model: when the card for the device appears its profile is set, and
+ * when the sink or source for that profile appears it is made the default. Each
+ * update of the model checks for the object each connection is waiting for, so
+ * there is no polling, and a single timeout ends a connection if PulseAudio
+ * never publishes the device.
+ */
+
+/* Start connecting a BlueZ device - trusts it, then connects it */
+
+static void bt_connect_device (VolumePulsePlugin *vol, const char *device, gboolean input)
 {
-    GDBusInterface *interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, device, "org.bluez.Device1");
+    BluetoothConnection *conn = bt_conn_new (vol, device, input);
+    GDBusInterface *interface;
+
+    interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, device, "org.bluez.Device1");
     DEBUG ("Connecting device %s - trusting...", device);
     if (interface)
     {
         // trust and connect
         g_dbus_proxy_call (G_DBUS_PROXY (interface), "org.freedesktop.DBus.Properties.Set", 
             g_variant_new ("(ssv)", g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)), "Trusted", g_variant_new_boolean (TRUE)),
-            G_DBUS_CALL_FLAGS_NONE, -1, NULL, bt_cb_trusted, vol);
+            G_DBUS_CALL_FLAGS_NONE, -1, conn->cancellable, bt_cb_trusted, conn);
         g_object_unref (interface);
     }
     else
     {
         DEBUG ("Couldn't get device interface from object manager");
-        char *msg = g_strdup_printf (_("Bluetooth %s device not found"), vol->bt_input ? "input" : "output");
-        bt_connect_dialog_update (vol, msg);
+        char *msg = g_strdup_printf (_("Bluetooth %s device not found"), input ? "input" : "output");
+        bt_conn_finish (conn, msg);
         g_free (msg);
     }
 }
 
-/* Callback for connect completed */
+/* Start a connection to a device, replacing any connection already in progress for it */
 
-static void bt_cb_connected (GObject *source, GAsyncResult *res, gpointer user_data)
+static BluetoothConnection *bt_conn_new (VolumePulsePlugin *vol, const char *path, gboolean input)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+    BluetoothConnection *conn;
+    GList *l;
+
+    for (l = vol->bt_conns; l != NULL; l = l->next)
+    {
+        if (!g_strcmp0 (((BluetoothConnection *) l->data)->path, path))
+        {
+            bt_conn_free ((BluetoothConnection *) l->data);
+            break;
+        }
+    }
+
+    conn = g_new0 (BluetoothConnection, 1);
+    conn->vol = vol;
+    conn->id = ++vol->bt_conn_serial;
+    conn->path = g_strdup (path);
+    conn->input = input;
+    conn->state = BT_CONN_IDLE;
+    conn->cancellable = g_cancellable_new ();
+    vol->bt_conns = g_list_prepend (vol->bt_conns, conn);
+    return conn;
+}
+
+/* Callback for trust completed */
+
+static void bt_cb_trusted (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    BluetoothConnection *conn = (BluetoothConnection *) user_data;
     GError *error = NULL;
 
     GVariant *var = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), res, &error);
     if (var) g_variant_unref (var);
 
+    // the connection has been freed if the call was cancelled
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_error_free (error);
+        return;
+    }
+
     if (error)
     {
-        DEBUG ("Connect error %s", error->message);
+        DEBUG ("Trusting error %s", error->message);
 
         // update dialog to show a warning
-        bt_connect_dialog_update (vol, error->message);
+        bt_conn_finish (conn, error->message);
         g_error_free (error);
     }
     else
     {
-        DEBUG ("Connected OK");
-
-        // start polling for the PulseAudio profile of the device
-        vol->bt_retry_count = 0;
-        vol->bt_retry_timer = g_timeout_add (100, bt_conn_set_profile, vol);
+        DEBUG ("Trusted OK - connecting");
+        GDBusInterface *interface = g_dbus_object_manager_get_interface (conn->vol->bt_objmanager, conn->path, "org.bluez.Device1");
+        if (interface)
+        {
+            g_dbus_proxy_call (G_DBUS_PROXY (interface), "Connect", NULL, G_DBUS_CALL_FLAGS_NONE, -1, conn->cancellable, bt_cb_connected, conn);
+            g_object_unref (interface);
+        }
+        else
+        {
+            DEBUG ("Couldn't get device interface from object manager");
+            char *msg = g_strdup_printf (_("Bluetooth %s device not found"), conn->input ? "input" : "output");
+            bt_conn_finish (conn, msg);
+            g_free (msg);
+        }
     }
 }
 
-/* Function polled after connection to confirm PA has found the device */
+/* Callback for connect completed */
 
-static gboolean bt_conn_set_profile (gpointer user_data)
+static void bt_cb_connected (GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
-    char *pacard, *msg;
-    int res;
+    BluetoothConnection *conn = (BluetoothConnection *) user_data;
+    GError *error = NULL;
+
+    GVariant *var = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), res, &error);
+    if (var) g_variant_unref (var);
 
-    // some devices take a very long time to be valid PulseAudio cards after connection
-    if (vol->bt_card_found == FALSE && vol->bt_retry_count++ < BT_PULSE_RETRIES) return TRUE;
-    vol->bt_retry_timer = 0;
+    // the connection has been freed if the call was cancelled
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_error_free (error);
+        return;
+    }
 
-    if (!vol->bt_card_found)
+    if (error)
     {
-        DEBUG ("Bluetooth device not found by PulseAudio - timeout");
+        DEBUG ("Connect error %s", error->message);
 
         // update dialog to show a warning
-        bt_connect_dialog_update (vol, _("Audio device not found"));
+        bt_conn_finish (conn, error->message);
+        g_error_free (error);
     }
     else
     {
-        pacard = bt_to_pa_name (vol->bt_conname, "card", NULL);
-        pulse_get_profile (vol, pacard);
-
-        DEBUG ("Bluetooth device found by PulseAudio with profile %s", vol->pa_profile);
-        if (vol->pipewire)
-            res = pulse_set_profile (vol, pacard, vol->bt_input ? "headset-head-unit" : "a2dp-sink");
-        else
-            res = pulse_set_profile (vol, pacard, vol->bt_input ? "handsfree_head_unit" : "a2dp_sink");
-
-        if (!res)
-        {
-            DEBUG ("Failed to set device profile : %s", vol->pa_error_msg);
-            msg = g_strdup_printf (_("Could not set profile for device : %s"), vol->pa_error_msg);
-            bt_connect_dialog_update (vol, msg);
-            g_free (msg);
-        }
-        else
-        {
-            pulse_get_profile (vol, pacard);
-            DEBUG ("Profile set to %s", vol->pa_profile);
-
-            vol->bt_retry_count = 0;
-            vol->bt_retry_timer = g_timeout_add (50, bt_conn_set_sink_source, vol);
-            g_free (pacard);
-            return FALSE;
-        }
-        g_free (pacard);
+        DEBUG ("Connected OK");
+        bt_conn_wait_card (conn);
     }
+}
 
-    volumepulse_update_display (vol);
-    return FALSE;
+/* Wait for PulseAudio to find the card for a connected device - it may already have done so */
+
+static void bt_conn_wait_card (BluetoothConnection *conn)
+{
+    conn->state = BT_CONN_WAIT_CARD;
+    conn->timer = g_timeout_add_seconds (BT_PULSE_TIMEOUT, bt_conn_timeout, conn);
+    bt_conn_set_profile (conn);
 }
 
-static gboolean bt_conn_set_sink_source (gpointer user_data)
+/* Set the profile of the device once its card is in the model */
+
+static void bt_conn_set_profile (BluetoothConnection *conn)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
-    char *pacard, *msg;
-    int res;
+    VolumePulsePlugin *vol = conn->vol;
+    const char *card = pulse_get_bluez_card (vol, conn->path);
+
+    if (!card) return;
 
+    DEBUG ("Bluetooth device found by PulseAudio");
+    conn->state = BT_CONN_SET_PROFILE;
     if (vol->pipewire)
-        pacard = bt_to_pa_name (vol->bt_conname, vol->bt_input ? "input" : "output", vol->bt_input ? "0" : "1");
+        conn->profile = conn->input ? "headset-head-unit" : "a2dp-sink";
     else
-        pacard = bt_to_pa_name (vol->bt_conname, vol->bt_input ? "source" : "sink", vol->bt_input ? "handsfree_head_unit" : "a2dp_sink");
+        conn->profile = conn->input ? "handsfree_head_unit" : "a2dp_sink";
 
-    if (vol->bt_input)
-        res = pulse_change_source (vol, pacard);
-    else
-        res = pulse_change_sink (vol, pacard);
+    // the rest of the connection is handled when the profile has been set
+    if (!pulse_set_profile (vol, card, conn->profile, bt_cb_profile_set, GUINT_TO_POINTER (conn->id)))
+        bt_conn_finish (conn, _("Could not set profile for device"));
+}
 
-    if (!res)
+/* Callback for profile set after connection - waits for the sink or source */
+
+static void bt_cb_profile_set (VolumePulsePlugin *vol, gboolean success, gpointer data)
+{
+    BluetoothConnection *conn = bt_conn_find (vol, GPOINTER_TO_UINT (data));
+    char *msg;
+
+    if (!conn || conn->state != BT_CONN_SET_PROFILE) return;
+
+    if (!success)
     {
-        if (vol->bt_retry_count++ < BT_PULSE_RETRIES)
-        {
-            g_free (pacard);
-            return TRUE;
-        }
-        msg = g_strdup_printf (_("Could not change %s to device : %s"), vol->bt_input ? "input" : "output", vol->pa_error_msg);
-        bt_connect_dialog_update (vol, msg);
+        DEBUG ("Failed to set device profile : %s", vol->pa_error_msg);
+        msg = g_strdup_printf (_("Could not set profile for device : %s"), vol->pa_error_msg);
+        bt_conn_finish (conn, msg);
         g_free (msg);
+        return;
     }
+
+    DEBUG ("Profile set");
+    conn->state = BT_CONN_WAIT_DEVICE;
+    bt_conn_set_sink_source (conn);
+}
+
+/* Make the sink or source of the device the default once it is in the model */
+
+static void bt_conn_set_sink_source (BluetoothConnection *conn)
+{
+    VolumePulsePlugin *vol = conn->vol;
+    const char *name;
+    int res;
+
+    // the sink or source for the old profile may still be in the model until the card has changed
+    if (g_strcmp0 (pulse_get_bluez_profile (vol, conn->path), conn->profile)) return;
+    name = pulse_get_bluez_device (vol, conn->path, conn->input);
+    if (!name) return;
+
+    conn->state = BT_CONN_SET_DEFAULT;
+    if (conn->input)
+        res = pulse_change_source (vol, name, bt_cb_sink_source_set, GUINT_TO_POINTER (conn->id));
     else
+        res = pulse_change_sink (vol, name, bt_cb_sink_source_set, GUINT_TO_POINTER (conn->id));
+
+    if (!res) bt_conn_finish (conn, _("Audio device not found"));
+}
+
+/* Callback for sink or source set after connection */
+
+static void bt_cb_sink_source_set (VolumePulsePlugin *vol, gboolean success, gpointer data)
+{
+    BluetoothConnection *conn = bt_conn_find (vol, GPOINTER_TO_UINT (data));
+    char *msg;
+
+    if (!conn || conn->state != BT_CONN_SET_DEFAULT) return;
+
+    if (!success)
     {
-        close_widget (&vol->conn_dialog);
-        //vsystem ("echo %s > ~/.%s", pacard, vol->bt_input ? "btin" : "btout");
+        msg = g_strdup_printf (_("Could not change %s to device : %s"), conn->input ? "input" : "output", vol->pa_error_msg);
+        bt_conn_finish (conn, msg);
+        g_free (msg);
+        return;
     }
-    g_free (pacard);
 
-    vol->bt_retry_timer = 0;
-    DEBUG ("Set sink / source polled %d times", vol->bt_retry_count);
+    if (conn->input) pulse_move_input_streams (vol);
+    else pulse_move_output_streams (vol);
+    bt_conn_finish (conn, NULL);
+}
+
+/* Timeout for PulseAudio publishing the device after connection */
 
-    volumepulse_update_display (vol);
+static gboolean bt_conn_timeout (gpointer user_data)
+{
+    BluetoothConnection *conn = (BluetoothConnection *) user_data;
+
+    DEBUG ("Bluetooth device %s not found by PulseAudio - timeout in state %d", conn->path, conn->state);
+    conn->timer = 0;
+    bt_conn_finish (conn, _("Audio device not found"));
     return FALSE;
 }
 
-/* Callback for trust completed */
+/* Find a connection in progress from its serial number */
 
-static void bt_cb_trusted (GObject *source, GAsyncResult *res, gpointer user_data)
+static BluetoothConnection *bt_conn_find (VolumePulsePlugin *vol, guint id)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
-    GError *error = NULL;
+    GList *l;
 
-    GVariant *var = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), res, &error);
-    if (var) g_variant_unref (var);
+    for (l = vol->bt_conns; l != NULL; l = l->next)
+        if (((BluetoothConnection *) l->data)->id == id) return (BluetoothConnection *) l->data;
+    return NULL;
+}
 
-    if (error)
-    {
-        DEBUG ("Trusting error %s", error->message);
+/* End a connection, showing a warning in the dialog if a message is supplied, or closing it if all connections have succeeded */
 
-        // update dialog to show a warning
-        bt_connect_dialog_update (vol, error->message);
-        g_error_free (error);
-    }
-    else
+static void bt_conn_finish (BluetoothConnection *conn, const char *msg)
+{
+    VolumePulsePlugin *vol = conn->vol;
+    gboolean input = conn->input;
+
+    bt_conn_free (conn);
+
+    // a device which was already connected has no dialog open, so one is opened for the warning
+    if (msg)
     {
-        DEBUG ("Trusted OK - connecting");
-        vol->bt_card_found = FALSE;
-        GDBusInterface *interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, vol->bt_conname, "org.bluez.Device1");
-        if (interface)
-        {
-            g_dbus_proxy_call (G_DBUS_PROXY (interface), "Connect", NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, bt_cb_connected, vol);
-            g_object_unref (interface);
-        }
-        else
-        {
-            DEBUG ("Couldn't get device interface from object manager");
-            char *msg = g_strdup_printf (_("Bluetooth %s device not found"), vol->bt_input ? "input" : "output");
-            bt_connect_dialog_update (vol, msg);
-            g_free (msg);
-        }
+        if (!vol->conn_dialog) bt_connect_dialog_show (vol, "");
+        bt_connect_dialog_update (vol, msg);
     }
+    else if (!vol->bt_conns && vol->conn_dialog && !gtk_widget_get_visible (vol->conn_ok)) close_widget (&vol->conn_dialog);
+    update_display (vol, input);
 }
 
-/* Check to see if a device has a particular service; i.e. is it input or output */
+/* Remove a connection from the list and free it, cancelling anything in progress */
 
-static gboolean bt_has_service (VolumePulsePlugin *vol, const gchar *path, const gchar *service)
+static void bt_conn_free (BluetoothConnection *conn)
+{
+    VolumePulsePlugin *vol = conn->vol;
+
+    if (conn->timer) g_source_remove (conn->timer);
+    g_cancellable_cancel (conn->cancellable);
+    g_object_unref (conn->cancellable);
+    vol->bt_conns = g_list_remove (vol->bt_conns, conn);
+    g_free (conn->path);
+    g_free (conn);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Device table                                                               */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The devices are kept in a table, keyed by object path, with their names, the
+ * audio services they offer and the directions they can be used in, along with
+ * counters of the usable output and input devices. The table is filled when BlueZ
+ * appears, and kept current from the object manager's signals, so that the device
+ * counts, menus and profiles dialog are read from it without walking every object
+ * BlueZ knows about. The UUIDs of a device are only parsed when they change.
+ */
+
+/* Parse the UUIDs of a device into a set of service flags */
+
+static guint bt_read_services (GDBusInterface *interface)
 {
-    GDBusInterface *interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, path, "org.bluez.Device1");
     GVariant *elem, *var = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "UUIDs");
     GVariantIter iter;
+    guint services = 0;
+
+    if (!var) return 0;
     g_variant_iter_init (&iter, var);
     while ((elem = g_variant_iter_next_value (&iter)))
     {
         const char *uuid = g_variant_get_string (elem, NULL);
-        if (!g_ascii_strncasecmp (uuid, service, 8)) return TRUE;
+        if (!g_ascii_strncasecmp (uuid, BT_SERV_AUDIO_SOURCE, 8)) services |= BT_SERVICE_AUDIO_SOURCE;
+        else if (!g_ascii_strncasecmp (uuid, BT_SERV_AUDIO_SINK, 8)) services |= BT_SERVICE_AUDIO_SINK;
+        else if (!g_ascii_strncasecmp (uuid, BT_SERV_HSP, 8)) services |= BT_SERVICE_HSP;
+        else if (!g_ascii_strncasecmp (uuid, BT_SERV_HFP, 8)) services |= BT_SERVICE_HFP;
         g_variant_unref (elem);
     }
     g_variant_unref (var);
+    return services;
+}
+
+/* Read a device from BlueZ, taking the services from the old record if supplied - returns a new record, or NULL if it is not a device */
+
+static BluetoothDevice *bt_read_device (VolumePulsePlugin *vol, const gchar *path, BluetoothDevice *old)
+{
+    GDBusInterface *interface;
+    GVariant *name, *icon, *paired, *trusted;
+    BluetoothDevice *dev;
+
+    if (!vol->bt_objmanager) return NULL;
+    interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, path, "org.bluez.Device1");
+    if (!interface) return NULL;
+
+    dev = g_new0 (BluetoothDevice, 1);
+    dev->services = old ? old->services : bt_read_services (interface);
+
+    name = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Alias");
+    icon = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Icon");
+    paired = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Paired");
+    trusted = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Trusted");
+    if (name && icon && paired && trusted && g_variant_get_boolean (paired) && g_variant_get_boolean (trusted))
+    {
+        dev->alias = g_variant_dup_string (name, NULL);
+        if (dev->services & BT_SERVICE_AUDIO_SINK) dev->counts |= BT_COUNT_OUTPUT;
+        if (dev->services & BT_SERVICE_HFP) dev->counts |= BT_COUNT_INPUT;
+    }
+    if (name) g_variant_unref (name);
+    if (icon) g_variant_unref (icon);
+    if (paired) g_variant_unref (paired);
+    if (trusted) g_variant_unref (trusted);
     g_object_unref (interface);
-    return FALSE;
+    return dev;
+}
+
+static void bt_device_free (gpointer data)
+{
+    BluetoothDevice *dev = (BluetoothDevice *) data;
+
+    g_free (dev->alias);
+    g_free (dev);
+}
+
+/* Update the table for a single device which has been added or changed - returns the directions whose menus need rebuilding */
+
+static guint bt_update_device (VolumePulsePlugin *vol, const gchar *path, gboolean services_changed)
+{
+    BluetoothDevice *old, *dev;
+    guint old_counts, counts, changed;
+
+    if (!vol->bt_devices) return 0;
+    old = g_hash_table_lookup (vol->bt_devices, path);
+    dev = bt_read_device (vol, path, services_changed ? NULL : old);
+    old_counts = old ? old->counts : 0;
+    counts = dev ? dev->counts : 0;
+
+    // a renamed device needs the menus it is in rebuilding, as well as any it has joined or left
+    changed = counts ^ old_counts;
+    if (old && dev && g_strcmp0 (old->alias, dev->alias)) changed |= counts;
+
+    vol->bt_count[0] += ((counts & BT_COUNT_OUTPUT) ? 1 : 0) - ((old_counts & BT_COUNT_OUTPUT) ? 1 : 0);
+    vol->bt_count[1] += ((counts & BT_COUNT_INPUT) ? 1 : 0) - ((old_counts & BT_COUNT_INPUT) ? 1 : 0);
+    if (dev) g_hash_table_insert (vol->bt_devices, g_strdup (path), dev);
+    else if (old) g_hash_table_remove (vol->bt_devices, path);
+    return changed;
+}
+
+/* Remove a device which has gone from the table - returns the directions it was counted in */
+
+static guint bt_remove_device (VolumePulsePlugin *vol, const gchar *path)
+{
+    BluetoothDevice *old;
+    guint counts;
+
+    if (!vol->bt_devices) return 0;
+    old = g_hash_table_lookup (vol->bt_devices, path);
+    if (!old) return 0;
+
+    counts = old->counts;
+    if (counts & BT_COUNT_OUTPUT) vol->bt_count[0]--;
+    if (counts & BT_COUNT_INPUT) vol->bt_count[1]--;
+    g_hash_table_remove (vol->bt_devices, path);
+    return counts;
+}
+
+/* Show or hide the icons, and rebuild the menus, for the directions whose devices have changed */
+
+static void bt_update_visibility (VolumePulsePlugin *vol, guint counts)
+{
+    if (counts & BT_COUNT_OUTPUT)
+    {
+        update_visibility (vol, FALSE);
+        menu_invalidate (vol, FALSE);
+    }
+    if (counts & BT_COUNT_INPUT)
+    {
+        update_visibility (vol, TRUE);
+        menu_invalidate (vol, TRUE);
+    }
+}
+
+/* Read all the devices BlueZ knows about - used when BlueZ first appears - returns the directions whose menus need rebuilding */
+
+static guint bt_read_all_devices (VolumePulsePlugin *vol)
+{
+    GList *objects, *obj;
+    guint counts = 0;
+
+    bt_clear_devices (vol);
+    objects = g_dbus_object_manager_get_objects (vol->bt_objmanager);
+    for (obj = objects; obj != NULL; obj = obj->next)
+        counts |= bt_update_device (vol, g_dbus_object_get_object_path (G_DBUS_OBJECT (obj->data)), TRUE);
+    g_list_free_full (objects, g_object_unref);
+    return counts;
+}
+
+static void bt_clear_devices (VolumePulsePlugin *vol)
+{
+    if (vol->bt_devices) g_hash_table_remove_all (vol->bt_devices);
+    vol->bt_count[0] = 0;
+    vol->bt_count[1] = 0;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -387,6 +704,15 @@ static void bt_connect_dialog_show (VolumePulsePlugin *vol, const char *fmt, ...
     g_vasprintf (&msg, fmt, arg);
     va_end (arg);
 
+    // a dialog already open for another connection just has its message replaced
+    if (vol->conn_dialog)
+    {
+        gtk_label_set_text (GTK_LABEL (vol->conn_label), msg);
+        gtk_widget_hide (vol->conn_ok);
+        g_free (msg);
+        return;
+    }
+
     textdomain (GETTEXT_PACKAGE);
 
     builder = gtk_builder_new_from_file (PACKAGE_DATA_DIR "/ui/lxplug-volumepulse.ui");
@@ -399,6 +725,7 @@ static void bt_connect_dialog_show (VolumePulsePlugin *vol, const char *fmt, ...
     g_object_unref (builder);
 
     gtk_label_set_text (GTK_LABEL (vol->conn_label), msg);
+    g_signal_connect (vol->conn_ok, "clicked", G_CALLBACK (bt_connect_dialog_ok), vol);
     gtk_widget_hide (vol->conn_ok);
 
     gtk_widget_show (vol->conn_dialog);
@@ -416,7 +743,6 @@ static void bt_connect_dialog_update (VolumePulsePlugin *vol, const gchar *msg)
     gtk_label_set_text (GTK_LABEL (vol->conn_label), buffer);
     g_free (buffer);
 
-    g_signal_connect (vol->conn_ok, "clicked", G_CALLBACK (bt_connect_dialog_ok), vol);
     gtk_widget_show (vol->conn_ok);
 }
 
@@ -436,7 +762,11 @@ static void bt_connect_dialog_ok (GtkButton *, VolumePulsePlugin *vol)
 void bluetooth_init (VolumePulsePlugin *vol)
 {
     /* Reset Bluetooth variables */
-    vol->bt_retry_timer = 0;
+    vol->bt_conns = NULL;
+    vol->bt_conn_serial = 0;
+    vol->bt_devices = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, bt_device_free);
+    vol->bt_count[0] = 0;
+    vol->bt_count[1] = 0;
 
     /* Set up callbacks to see if BlueZ is on D-Bus */
     vol->bt_watcher_id = g_bus_watch_name (G_BUS_TYPE_SYSTEM, "org.bluez", 0, bt_cb_name_owned, bt_cb_name_unowned, vol, NULL);
@@ -446,11 +776,12 @@ void bluetooth_init (VolumePulsePlugin *vol)
 
 void bluetooth_terminate (VolumePulsePlugin *vol)
 {
-    if (vol->bt_retry_timer) g_source_remove (vol->bt_retry_timer);
+    while (vol->bt_conns) bt_conn_free ((BluetoothConnection *) vol->bt_conns->data);
 
     /* Remove signal handlers on D-Bus object manager */
     if (vol->bt_objmanager)
     {
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_object_added), vol);
         g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_object_removed), vol);
         g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_interface_properties), vol);
         g_object_unref (vol->bt_objmanager);
@@ -459,6 +790,10 @@ void bluetooth_terminate (VolumePulsePlugin *vol)
 
     /* Remove the watch on D-Bus */
     g_bus_unwatch_name (vol->bt_watcher_id);
+
+    bt_clear_devices (vol);
+    if (vol->bt_devices) g_hash_table_destroy (vol->bt_devices);
+    vol->bt_devices = NULL;
 }
 
 /* Check to see if a Bluetooth device is connected */
@@ -477,224 +812,117 @@ gboolean bt_is_connected (VolumePulsePlugin *vol, const char *path)
 
 void bluetooth_set_output (VolumePulsePlugin *vol, const char *name, const char *label)
 {
-    char *pacard;
-
     if (bt_is_connected (vol, name))
     {
         DEBUG ("Bluetooth output device already connected");
 
-        pacard = bt_to_pa_name (name, "card", NULL);
-        pulse_get_profile (vol, pacard);
-        g_free (pacard);
+        const char *sink = pulse_get_bluez_device (vol, name, FALSE);
+        if (!sink || !pulse_change_sink (vol, sink, bt_cb_output_set, NULL)) bt_cb_output_set (vol, FALSE, NULL);
+    }
+    else
+    {
+        bt_connect_dialog_show (vol, _("Connecting Bluetooth device '%s' as output..."), label);
+        bt_connect_device (vol, name, FALSE);
+    }
+}
 
-        if (vol->pipewire)
-        {
-            pacard = bt_to_pa_name (name, "output", "1");
-        }
-        else
-        {
-            pacard = bt_to_pa_name (name, "sink", vol->pa_profile);
-        }
+/* Callback for default sink set for a connected output device */
 
-        if (pulse_change_sink (vol, pacard))
-        {
-            pulse_move_output_streams (vol);
-            //vsystem ("echo %s > ~/.btout", pacard);
-        }
-        else
-        {
-            bt_connect_dialog_show (vol, "");
-            bt_connect_dialog_update (vol, _("Could not set device as output"));
-        }
-        g_free (pacard);
+static void bt_cb_output_set (VolumePulsePlugin *vol, gboolean success, gpointer)
+{
+    if (success)
+    {
+        pulse_move_output_streams (vol);
     }
     else
     {
-        bt_connect_dialog_show (vol, _("Connecting Bluetooth device '%s' as output..."), label);
-        vol->bt_conname = g_strdup (name);
-        vol->bt_input = FALSE;
-        bt_connect_device (vol, name);
+        bt_connect_dialog_show (vol, "");
+        bt_connect_dialog_update (vol, _("Could not set device as output"));
     }
+    update_display (vol, FALSE);
 }
 
 /* Set a BlueZ device as the default PulseAudio source */
 
 void bluetooth_set_input (VolumePulsePlugin *vol, const char *name, const char *label)
 {
-    char *pacard;
-
     if (bt_is_connected (vol, name))
     {
         DEBUG ("Bluetooth input device already connected");
 
-        pacard = bt_to_pa_name (name, "card", NULL);
-        pulse_get_profile (vol, pacard);
-        pulse_set_profile (vol, pacard, vol->pipewire ? "headset-head-unit" : "handsfree_head_unit");
-        g_free (pacard);
-
-        if (vol->pipewire)
-        {
-            pacard = bt_to_pa_name (name, "input", "0");
-        }
-        else
-        {
-            pacard = bt_to_pa_name (name, "source", "handsfree_head_unit");
-        }
-
-        if (pulse_change_source (vol, pacard))
-        {
-            pulse_move_input_streams (vol);
-            //vsystem ("echo %s > ~/.btin", pacard);
-        }
-        else
-        {
-            bt_connect_dialog_show (vol, "");
-            bt_connect_dialog_update (vol, _("Could not set device as output"));
-        }
-        g_free (pacard);
+        // input needs the headset profile, so the connection is picked up from setting that
+        bt_conn_wait_card (bt_conn_new (vol, name, TRUE));
     }
     else
     {
         bt_connect_dialog_show (vol, _("Connecting Bluetooth device '%s' as input..."), label);
-        vol->bt_conname = g_strdup (name);
-        vol->bt_input = TRUE;
-        bt_connect_device (vol, name);
+        bt_connect_device (vol, name, TRUE);
     }
 }
 
-/* Loop through the devices BlueZ knows about, adding them to the device menu */
+/* Loop through the usable devices in the table, adding them to the device menu */
 
 void bluetooth_add_devices_to_menu (VolumePulsePlugin *vol, gboolean input_control)
 {
+    GHashTableIter iter;
+    gpointer key, value;
+
     vol->separator = FALSE;
-    if (vol->bt_objmanager)
+    if (!vol->bt_devices) return;
+
+    g_hash_table_iter_init (&iter, vol->bt_devices);
+    while (g_hash_table_iter_next (&iter, &key, &value))
     {
-        // iterate all the objects the manager knows about
-        GList *objects = g_dbus_object_manager_get_objects (vol->bt_objmanager);
-        while (objects != NULL)
-        {
-            GDBusObject *object = (GDBusObject *) objects->data;
-            const char *objpath = g_dbus_object_get_object_path (object);
-            GList *interfaces = g_dbus_object_get_interfaces (object);
-            while (interfaces != NULL)
-            {
-                // if an object has a Device1 interface, it is a Bluetooth device - add it to the list
-                GDBusInterface *interface = G_DBUS_INTERFACE (interfaces->data);
-                if (g_strcmp0 (g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)), "org.bluez.Device1") == 0)
-                {
-                    if (bt_has_service (vol, g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface)), input_control ? BT_SERV_HFP : BT_SERV_AUDIO_SINK))
-                    {
-                        GVariant *name = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Alias");
-                        GVariant *icon = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Icon");
-                        GVariant *paired = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Paired");
-                        GVariant *trusted = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Trusted");
-                        if (name && icon && paired && trusted && g_variant_get_boolean (paired) && g_variant_get_boolean (trusted))
-                        {
-                            // create a menu if there isn't one already
-                            menu_add_separator (vol, vol->menu_devices[input_control ? 1 : 0]);
-                            menu_add_item (vol, g_variant_get_string (name, NULL), objpath, input_control);
-                        }
-                        g_variant_unref (name);
-                        g_variant_unref (icon);
-                        g_variant_unref (paired);
-                        g_variant_unref (trusted);
-                    }
-                    break;
-                }
-                interfaces = interfaces->next;
-            }
-            objects = objects->next;
-        }
+        BluetoothDevice *dev = (BluetoothDevice *) value;
+        if (!(dev->counts & (input_control ? BT_COUNT_INPUT : BT_COUNT_OUTPUT))) continue;
+
+        menu_add_separator (vol, vol->menu_devices[input_control ? 1 : 0]);
+        menu_add_item (vol, dev->alias, (const char *) key, input_control);
     }
 }
 
-/* Loop through the devices BlueZ knows about, adding them to the profiles dialog */
+/* Loop through the usable devices in the table, adding them to the profiles dialog */
 
 void bluetooth_add_devices_to_profile_dialog (VolumePulsePlugin *vol)
 {
-    if (vol->bt_objmanager)
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!vol->bt_devices) return;
+
+    g_hash_table_iter_init (&iter, vol->bt_devices);
+    while (g_hash_table_iter_next (&iter, &key, &value))
     {
-        // iterate all the objects the manager knows about
-        GList *objects = g_dbus_object_manager_get_objects (vol->bt_objmanager);
-        while (objects != NULL)
-        {
-            GDBusObject *object = (GDBusObject *) objects->data;
-            const char *objpath = g_dbus_object_get_object_path (object);
-            GList *interfaces = g_dbus_object_get_interfaces (object);
-            while (interfaces != NULL)
-            {
-                // if an object has a Device1 interface, it is a Bluetooth device - add it to the list
-                GDBusInterface *interface = G_DBUS_INTERFACE (interfaces->data);
-                if (g_strcmp0 (g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)), "org.bluez.Device1") == 0)
-                {
-                    if (bt_has_service (vol, g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface)), BT_SERV_HFP)
-                        || bt_has_service (vol, g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface)), BT_SERV_AUDIO_SINK))
-                    {
-                        GVariant *name = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Alias");
-                        GVariant *icon = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Icon");
-                        GVariant *paired = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Paired");
-                        GVariant *trusted = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Trusted");
-                        if (name && icon && paired && trusted && g_variant_get_boolean (paired) && g_variant_get_boolean (trusted))
-                        {
-                            // only disconnected devices here...
-                            char *pacard = bt_to_pa_name ((char *) objpath, "card", NULL);
-                            pulse_get_profile (vol, pacard);
-                            if (vol->pa_profile == NULL)
-                                profiles_dialog_add_combo (vol, NULL, vol->profiles_bt_box, 0, g_variant_get_string (name, NULL), NULL);
-                        }
-                        g_variant_unref (name);
-                        g_variant_unref (icon);
-                        g_variant_unref (paired);
-                        g_variant_unref (trusted);
-                    }
-                    break;
-                }
-                interfaces = interfaces->next;
-            }
-            objects = objects->next;
-        }
+        BluetoothDevice *dev = (BluetoothDevice *) value;
+        if (!dev->counts) continue;
+
+        // only disconnected devices here...
+        if (!pulse_get_bluez_card (vol, (const char *) key))
+            profiles_dialog_add_combo (vol, NULL, vol->profiles_bt_box, 0, dev->alias, NULL);
     }
 }
 
-/* Loop through the devices BlueZ knows about, counting them */
+/* Continue any connections which are waiting for their card, sink or source to appear - called when the PulseAudio model changes */
 
-int bluetooth_count_devices (VolumePulsePlugin *vol, gboolean input)
+void bluetooth_pulse_changed (VolumePulsePlugin *vol)
 {
-    int count = 0;
-    if (vol->bt_objmanager)
+    GList *l, *next;
+
+    // a connection may end as it is continued, so the next one is found first
+    for (l = vol->bt_conns; l != NULL; l = next)
     {
-        // iterate all the objects the manager knows about
-        GList *objects = g_dbus_object_manager_get_objects (vol->bt_objmanager);
-        while (objects != NULL)
-        {
-            GDBusObject *object = (GDBusObject *) objects->data;
-            GList *interfaces = g_dbus_object_get_interfaces (object);
-            while (interfaces != NULL)
-            {
-                // if an object has a Device1 interface, it is a Bluetooth device - add it to the list
-                GDBusInterface *interface = G_DBUS_INTERFACE (interfaces->data);
-                if (g_strcmp0 (g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)), "org.bluez.Device1") == 0)
-                {
-                    if (bt_has_service (vol, g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface)), input ? BT_SERV_HFP : BT_SERV_AUDIO_SINK))
-                    {
-                        GVariant *name = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Alias");
-                        GVariant *icon = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Icon");
-                        GVariant *paired = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Paired");
-                        GVariant *trusted = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Trusted");
-                        if (name && icon && paired && trusted && g_variant_get_boolean (paired) && g_variant_get_boolean (trusted)) count++;
-                        g_variant_unref (name);
-                        g_variant_unref (icon);
-                        g_variant_unref (paired);
-                        g_variant_unref (trusted);
-                    }
-                    break;
-                }
-                interfaces = interfaces->next;
-            }
-            objects = objects->next;
-        }
+        BluetoothConnection *conn = (BluetoothConnection *) l->data;
+        next = l->next;
+        if (conn->state == BT_CONN_WAIT_CARD) bt_conn_set_profile (conn);
+        else if (conn->state == BT_CONN_WAIT_DEVICE) bt_conn_set_sink_source (conn);
     }
-    return count;
+}
+
+/* Get the number of usable devices BlueZ knows about */
+
+int bluetooth_count_devices (VolumePulsePlugin *vol, gboolean input)
+{
+    return vol->bt_count[input ? 1 : 0];
 }
 
 /* End of file */
@@ -38,6 +38,7 @@ extern void bluetooth_set_input (VolumePulsePlugin *vol, const char *name, const
 extern void bluetooth_add_devices_to_menu (VolumePulsePlugin *vol, gboolean input_control);
 extern void bluetooth_add_devices_to_profile_dialog (VolumePulsePlugin *vol);
 extern int bluetooth_count_devices (VolumePulsePlugin *vol, gboolean input);
+extern void bluetooth_pulse_changed (VolumePulsePlugin *vol);
 
 /* End of file */
 /*----------------------------------------------------------------------------*/
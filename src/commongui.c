@@ -45,6 +45,24 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /* Typedefs and macros                                                        */
 /*----------------------------------------------------------------------------*/
 
+/* Title and combo box for one device in the profiles dialog, before it is packed */
+
+typedef struct
+{
+    GtkWidget *dest;                    /* Box into which the row is packed */
+    GtkWidget *label;                   /* Title label */
+    GtkWidget *combo;                   /* Profile combo box */
+    char *key;                          /* Collation key of the title */
+} ProfilesRow;
+
+/* Profile change requested from the profiles dialog, kept until the model settles */
+
+typedef struct
+{
+    char *profile;                      /* Name of the profile requested */
+    gboolean done;                      /* Change has completed successfully on the server */
+} ProfilesPending;
+
 /*----------------------------------------------------------------------------*/
 /* Global data                                                                */
 /*----------------------------------------------------------------------------*/
@@ -53,18 +71,30 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /* Prototypes                                                                 */
 /*----------------------------------------------------------------------------*/
 
+static void set_taskbar_icon (VolumePulsePlugin *vol, gboolean input, const char *icon);
 static void mouse_scrolled (GtkScale *, GdkEventScroll *evt, VolumePulsePlugin *vol, gboolean input);
 static void vol_destroyed (GtkWidget *widget, gpointer data);
+static void popup_window_create_box (VolumePulsePlugin *vol, gboolean input_control);
 static void popup_window_scale_changed_vol (GtkRange *range, VolumePulsePlugin *vol);
 static void popup_window_mute_toggled_vol (GtkWidget *widget, VolumePulsePlugin *vol);
 static void popup_window_scale_changed_mic (GtkRange *range, VolumePulsePlugin *vol);
 static void popup_window_mute_toggled_mic (GtkWidget *widget, VolumePulsePlugin *vol);
 static void menu_create (VolumePulsePlugin *vol, gboolean input_control);
+static gint menu_compare_items (gconstpointer a, gconstpointer b);
+static void menu_append_section (VolumePulsePlugin *vol, gboolean input_control);
+static gboolean menu_prefetch_step (gpointer data);
 static void menu_open_profile_dialog (GtkWidget *, VolumePulsePlugin *vol);
-static void menu_mark_default_input (GtkWidget *widget, gpointer data);
-static void menu_mark_default_output (GtkWidget *widget, gpointer data);
-static void profiles_dialog_relocate_last_item (GtkWidget *box);
+static void menu_mark_default (VolumePulsePlugin *vol, gboolean input);
+static void menu_set_item_active (GtkWidget *widget, gboolean active);
+static gboolean profiles_dialog_fill (gpointer data);
+static void profiles_dialog_destroyed (GtkWidget *, VolumePulsePlugin *vol);
+static void profiles_dialog_add_devices (VolumePulsePlugin *vol);
+static gint profiles_dialog_compare_rows (gconstpointer a, gconstpointer b);
+static void profiles_dialog_free_row (gpointer data);
 static void profiles_dialog_combo_changed (GtkComboBox *combo, VolumePulsePlugin *vol);
+static void profiles_dialog_profile_set (VolumePulsePlugin *vol, gboolean success, gpointer data);
+static gboolean profiles_dialog_confirm_profile (gpointer key, gpointer value, gpointer data);
+static void profiles_dialog_free_pending (gpointer data);
 static void profiles_dialog_ok (GtkButton *button, VolumePulsePlugin *vol);
 static gboolean profiles_dialog_delete (GtkWidget *wid, GdkEvent *event, VolumePulsePlugin *vol);
 
@@ -148,12 +178,22 @@ const char *device_display_name (VolumePulsePlugin *vol, const char *name)
 /* Icons                                                                      */
 /*----------------------------------------------------------------------------*/
 
-void update_display (VolumePulsePlugin *vol, gboolean input)
+/*
+ * The icon name, visibility and tooltip level last set on each plugin button are
+ * remembered, and the widgets are only touched when one of these changes, so that
+ * notifications which do not change what is shown cause no icon lookups or relayout.
+ */
+
+/* Show or hide the icon for one direction, depending on whether there are any devices */
+
+void update_visibility (VolumePulsePlugin *vol, gboolean input)
 {
-    const char *icon;
+    int visible = (!input || !vol->wizard) && pulse_count_devices (vol, input) + bluetooth_count_devices (vol, input) > 0;
+
+    if (visible == vol->visible_shown[input ? 1 : 0]) return;
+    vol->visible_shown[input ? 1 : 0] = visible;
 
-    pulse_count_devices (vol, input);
-    if ((!input || !vol->wizard) && vol->pa_devices + bluetooth_count_devices (vol, input) > 0)
+    if (visible)
     {
         gtk_widget_show_all (vol->plugin[input ? 1 : 0]);
         gtk_widget_set_sensitive (vol->plugin[input ? 1 : 0], TRUE);
@@ -163,6 +203,33 @@ void update_display (VolumePulsePlugin *vol, gboolean input)
         gtk_widget_hide (vol->plugin[input ? 1 : 0]);
         gtk_widget_set_sensitive (vol->plugin[input ? 1 : 0], FALSE);
     }
+}
+
+/*
+ * Forget what is shown, so that the next update sets everything, and discard the
+ * rendered icons - used when the panel configuration, icon size or theme changes
+ */
+
+void invalidate_display (VolumePulsePlugin *vol)
+{
+    if (vol->icon_atlas) g_hash_table_remove_all (vol->icon_atlas);
+    else vol->icon_atlas = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
+
+    vol->icon_shown[0] = NULL;
+    vol->icon_shown[1] = NULL;
+    vol->visible_shown[0] = -1;
+    vol->visible_shown[1] = -1;
+    vol->tooltip_shown[0] = -1;
+    vol->tooltip_shown[1] = -1;
+}
+
+/* Update the icon, tooltip and popup controls for one direction */
+
+void update_display (VolumePulsePlugin *vol, gboolean input)
+{
+    const char *icon;
+
+    update_visibility (vol, input);
 
     /* read current mute and volume status */
     gboolean mute = pulse_get_mute (vol, input);
@@ -186,7 +253,11 @@ void update_display (VolumePulsePlugin *vol, gboolean input)
             else icon = "audio-volume-silent";
         }
     }
-    wrap_set_taskbar_icon (vol, vol->tray_icon[input ? 1 : 0], icon);
+    if (g_strcmp0 (icon, vol->icon_shown[input ? 1 : 0]))
+    {
+        set_taskbar_icon (vol, input, icon);
+        vol->icon_shown[input ? 1 : 0] = icon;
+    }
 
     /* update popup window controls */
     if (vol->popup_window[input ? 1 : 0])
@@ -203,9 +274,37 @@ void update_display (VolumePulsePlugin *vol, gboolean input)
     }
 
     /* update tooltip */
-    char *tooltip = g_strdup_printf ("%s %d", input ? _("Mic volume") : _("Volume control"), level);
-    if (!vol->wizard) gtk_widget_set_tooltip_text (vol->plugin[input ? 1 : 0], tooltip);
-    g_free (tooltip);
+    if (!vol->wizard && level != vol->tooltip_shown[input ? 1 : 0])
+    {
+        char *tooltip = g_strdup_printf ("%s %d", input ? _("Mic volume") : _("Volume control"), level);
+        gtk_widget_set_tooltip_text (vol->plugin[input ? 1 : 0], tooltip);
+        vol->tooltip_shown[input ? 1 : 0] = level;
+        g_free (tooltip);
+    }
+}
+
+/*
+ * Each icon is loaded from the theme the first time it is shown at the current
+ * size, and the pixbuf the panel renders is kept, so that later changes of state
+ * just swap the pixbuf in the image rather than looking up the theme again.
+ */
+
+static void set_taskbar_icon (VolumePulsePlugin *vol, gboolean input, const char *icon)
+{
+    GtkImage *image = GTK_IMAGE (vol->tray_icon[input ? 1 : 0]);
+    GdkPixbuf *pixbuf = vol->icon_atlas ? g_hash_table_lookup (vol->icon_atlas, icon) : NULL;
+
+    if (pixbuf)
+    {
+        gtk_image_set_from_pixbuf (image, pixbuf);
+        return;
+    }
+
+    wrap_set_taskbar_icon (vol, vol->tray_icon[input ? 1 : 0], icon);
+
+    // icon names are constant strings, so can be used as keys without copying
+    if (vol->icon_atlas && gtk_image_get_storage_type (image) == GTK_IMAGE_PIXBUF)
+        g_hash_table_insert (vol->icon_atlas, (gpointer) icon, g_object_ref (gtk_image_get_pixbuf (image)));
 }
 
 /*----------------------------------------------------------------------------*/
@@ -248,47 +347,44 @@ void micpulse_mouse_scrolled (GtkScale *scale, GdkEventScroll *event, VolumePuls
 /* Volume scale popup window                                                  */
 /*----------------------------------------------------------------------------*/
 
+/*
+ * The panel destroys the popup window when it is dismissed, so the scale and
+ * check button are built once into a box which is kept between openings; each
+ * opening just puts the box into a new window, and the box is taken out of the
+ * window again before the window is destroyed. The controls are set from the
+ * local model by update_display after the window is shown.
+ */
+
 static void vol_destroyed (GtkWidget *widget, gpointer data)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) data;
-    if (widget == vol->popup_window[0])
-    {
-        g_signal_handlers_disconnect_matched (vol->popup_window[0], G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, vol);
-        g_signal_handlers_disconnect_matched (vol->popup_volume_scale[0], G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, vol);
-        g_signal_handlers_disconnect_matched (vol->popup_mute_check[0], G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, vol);
-        vol->popup_window[0] = NULL;
-    }
-    if (widget == vol->popup_window[1])
+    int index;
+
+    for (index = 0; index < 2; index++)
     {
-        g_signal_handlers_disconnect_matched (vol->popup_window[1], G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, vol);
-        g_signal_handlers_disconnect_matched (vol->popup_volume_scale[1], G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, vol);
-        g_signal_handlers_disconnect_matched (vol->popup_mute_check[1], G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, vol);
-        vol->popup_window[1] = NULL;
+        if (widget != vol->popup_window[index]) continue;
+        g_signal_handlers_disconnect_matched (vol->popup_window[index], G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, vol);
+        gtk_container_remove (GTK_CONTAINER (vol->popup_window[index]), vol->popup_box[index]);
+        vol->popup_window[index] = NULL;
     }
 }
 
-/* Create the pop-up volume window */
+/* Create the contents of the pop-up volume window */
 
-void popup_window_show (VolumePulsePlugin *vol, gboolean input_control)
+static void popup_window_create_box (VolumePulsePlugin *vol, gboolean input_control)
 {
     int index = input_control ? 1 : 0;
 
-    /* Create a new window. */
-    vol->popup_window[index] = gtk_window_new (GTK_WINDOW_TOPLEVEL);
-    gtk_widget_set_name (vol->popup_window[index], "panelpopup");
-
-    gtk_container_set_border_width (GTK_CONTAINER (vol->popup_window[index]), 0);
-
-    /* Create a vertical box as the child of the window. */
-    GtkWidget *box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
-    gtk_container_add (GTK_CONTAINER (vol->popup_window[index]), box);
+    /* Create a vertical box, which is kept when the window is destroyed. */
+    vol->popup_box[index] = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
+    g_object_ref_sink (vol->popup_box[index]);
 
     /* Create a vertical scale as the child of the vertical box. */
     vol->popup_volume_scale[index] = gtk_scale_new (GTK_ORIENTATION_VERTICAL, GTK_ADJUSTMENT (gtk_adjustment_new (100, 0, 100, 0, 0, 0)));
     g_object_set (vol->popup_volume_scale[index], "height-request", 120, NULL);
     gtk_scale_set_draw_value (GTK_SCALE (vol->popup_volume_scale[index]), FALSE);
     gtk_range_set_inverted (GTK_RANGE (vol->popup_volume_scale[index]), TRUE);
-    gtk_box_pack_start (GTK_BOX (box), vol->popup_volume_scale[index], TRUE, TRUE, 0);
+    gtk_box_pack_start (GTK_BOX (vol->popup_box[index]), vol->popup_volume_scale[index], TRUE, TRUE, 0);
     gtk_widget_set_can_focus (vol->popup_volume_scale[index], FALSE);
 
     /* Value-changed and scroll-event signals. */
@@ -297,15 +393,48 @@ void popup_window_show (VolumePulsePlugin *vol, gboolean input_control)
 
     /* Create a check button as the child of the vertical box. */
     vol->popup_mute_check[index] = gtk_check_button_new_with_label (_("Mute"));
-    gtk_box_pack_end (GTK_BOX (box), vol->popup_mute_check[index], FALSE, FALSE, 0);
+    gtk_box_pack_end (GTK_BOX (vol->popup_box[index]), vol->popup_mute_check[index], FALSE, FALSE, 0);
     vol->mute_check_handler[index] = g_signal_connect (vol->popup_mute_check[index], "toggled", input_control ? G_CALLBACK (popup_window_mute_toggled_mic) : G_CALLBACK (popup_window_mute_toggled_vol), vol);
     gtk_widget_set_can_focus (vol->popup_mute_check[index], FALSE);
+}
+
+/* Create the pop-up volume window */
+
+void popup_window_show (VolumePulsePlugin *vol, gboolean input_control)
+{
+    int index = input_control ? 1 : 0;
+
+    if (!vol->popup_box[index]) popup_window_create_box (vol, input_control);
+
+    /* Create a new window. */
+    vol->popup_window[index] = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+    gtk_widget_set_name (vol->popup_window[index], "panelpopup");
+
+    gtk_container_set_border_width (GTK_CONTAINER (vol->popup_window[index]), 0);
+
+    /* Add the box of controls as the child of the window. */
+    gtk_container_add (GTK_CONTAINER (vol->popup_window[index]), vol->popup_box[index]);
     g_signal_connect (vol->popup_window[index], "destroy", G_CALLBACK (vol_destroyed), vol);
 
     /* Realise the window */
     wrap_popup_at_button (vol, vol->popup_window[index], vol->plugin[index]);
 }
 
+/* Destroy the contents of the pop-up volume windows - the windows themselves must already have been closed */
+
+void popup_window_free (VolumePulsePlugin *vol)
+{
+    int index;
+
+    for (index = 0; index < 2; index++)
+    {
+        if (!vol->popup_box[index]) continue;
+        gtk_widget_destroy (vol->popup_box[index]);
+        g_object_unref (vol->popup_box[index]);
+        vol->popup_box[index] = NULL;
+    }
+}
+
 /* Handler for "value_changed" signal on popup window vertical scale */
 
 static void popup_window_scale_changed_vol (GtkRange *range, VolumePulsePlugin *vol)
@@ -350,20 +479,34 @@ static void popup_window_mute_toggled_mic (GtkWidget *widget, VolumePulsePlugin
 /* Device select menu                                                         */
 /*----------------------------------------------------------------------------*/
 
+/*
+ * The menus are kept between openings. Changes to the device states and the
+ * default device are patched into them as they are notified; when devices are
+ * added or removed, a menu is rebuilt straight away if it is open, and otherwise
+ * marked stale and rebuilt when it is next opened. Either way the menu is built
+ * from the local models, so opening it needs no server or D-Bus access.
+ */
+
 void menu_show (VolumePulsePlugin *vol, gboolean input)
 {
-    // create the menu
-    menu_create (vol, input);
+    int index = input ? 1 : 0;
 
-    // lock menu if a dialog is open
+    // create or rebuild the menu if the devices have changed
+    if (!vol->menu_devices[index] || vol->menu_stale[index]) menu_create (vol, input);
+    else menu_mark_default (vol, input);
+
+    // lock menu if a dialog is open - it then needs rebuilding to unlock it
     if (vol->conn_dialog || vol->profiles_dialog)
-        gtk_container_foreach (GTK_CONTAINER (vol->menu_devices[input ? 1 : 0]), (void *) gtk_widget_set_sensitive, FALSE);
+    {
+        gtk_container_foreach (GTK_CONTAINER (vol->menu_devices[index]), (void *) gtk_widget_set_sensitive, FALSE);
+        vol->menu_stale[index] = TRUE;
+    }
 
     // show the menu
-    gtk_widget_show_all (vol->menu_devices[input ? 1 : 0]);
+    gtk_widget_show_all (vol->menu_devices[index]);
 }
 
-/* Create the device select menu */
+/* Create the device select menu, or empty and refill it if it already exists */
 
 static void menu_create (VolumePulsePlugin *vol, gboolean input_control)
 {
@@ -372,25 +515,37 @@ static void menu_create (VolumePulsePlugin *vol, gboolean input_control)
     int index = input_control ? 1 : 0;
 
     // create input selector
-    if (vol->menu_devices[index]) gtk_widget_destroy (vol->menu_devices[index]);
-    vol->menu_devices[index] = gtk_menu_new ();
-    gtk_widget_set_name (vol->menu_devices[index], "panelmenu");
+    if (vol->menu_devices[index])
+    {
+        gtk_container_foreach (GTK_CONTAINER (vol->menu_devices[index]), (void *) gtk_widget_destroy, NULL);
+        g_hash_table_remove_all (vol->menu_items[index]);
+    }
+    else
+    {
+        vol->menu_devices[index] = gtk_menu_new ();
+        gtk_widget_set_name (vol->menu_devices[index], "panelmenu");
+        vol->menu_items[index] = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+    vol->menu_default[index] = NULL;
+    vol->menu_stale[index] = FALSE;
 
     // add internal devices
     pulse_add_devices_to_menu (vol, TRUE, input_control);
+    menu_append_section (vol, input_control);
 
     // add ALSA devices
     pulse_add_devices_to_menu (vol, FALSE, input_control);
+    menu_append_section (vol, input_control);
 
     // add Bluetooth devices
     bluetooth_add_devices_to_menu (vol, input_control);
+    menu_append_section (vol, input_control);
 
     // update the menu item names, which are currently ALSA device names, to PulseAudio sink/source names
     pulse_update_devices_in_menu (vol, input_control);
 
     // show the default sink and source in the menu
-    pulse_get_default_sink_source (vol);
-    gtk_container_foreach (GTK_CONTAINER (vol->menu_devices[index]), input_control ? menu_mark_default_input : menu_mark_default_output, vol);
+    menu_mark_default (vol, input_control);
 
     // did we find any devices? if not, the menu will be empty...
     items = gtk_container_get_children (GTK_CONTAINER (vol->menu_devices[index]));
@@ -418,6 +573,75 @@ static void menu_create (VolumePulsePlugin *vol, gboolean input_control)
     }
 }
 
+/* Update the device states and default device in the menu after a change on the server */
+
+void menu_update (VolumePulsePlugin *vol, gboolean input)
+{
+    GtkWidget *menu = vol->menu_devices[input ? 1 : 0];
+
+    if (!menu || vol->menu_stale[input ? 1 : 0]) return;
+
+    pulse_update_devices_in_menu (vol, input);
+    menu_mark_default (vol, input);
+
+    // keep menu locked if a dialog is open
+    if (vol->conn_dialog || vol->profiles_dialog)
+    {
+        gtk_container_foreach (GTK_CONTAINER (menu), (void *) gtk_widget_set_sensitive, FALSE);
+        vol->menu_stale[input ? 1 : 0] = TRUE;
+    }
+}
+
+/* Rebuild the menu after devices have been added or removed - now if it is open, otherwise when it is next opened */
+
+void menu_invalidate (VolumePulsePlugin *vol, gboolean input)
+{
+    GtkWidget *menu = vol->menu_devices[input ? 1 : 0];
+
+    if (!menu) return;
+    if (gtk_widget_get_visible (menu)) menu_show (vol, input);
+    else vol->menu_stale[input ? 1 : 0] = TRUE;
+}
+
+/*
+ * The first opening of each menu is otherwise the slowest, as it creates all the
+ * widgets. Once the local models have been read at startup, the menus are built
+ * from a low-priority idle source, one menu per call, so that any pending input
+ * or redraw is handled first; a menu which has already been built is skipped.
+ */
+
+void menu_prefetch (VolumePulsePlugin *vol)
+{
+    menu_prefetch_cancel (vol);
+    vol->menu_prefetch_step = 0;
+    vol->menu_prefetch_idle = g_idle_add_full (G_PRIORITY_LOW, menu_prefetch_step, vol, NULL);
+}
+
+void menu_prefetch_cancel (VolumePulsePlugin *vol)
+{
+    if (vol->menu_prefetch_idle) g_source_remove (vol->menu_prefetch_idle);
+    vol->menu_prefetch_idle = 0;
+}
+
+static gboolean menu_prefetch_step (gpointer data)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) data;
+    gboolean input = vol->menu_prefetch_step++ ? TRUE : FALSE;
+
+    if (!vol->menu_devices[input ? 1 : 0] || vol->menu_stale[input ? 1 : 0])
+    {
+        DEBUG ("Prefetching %s menu", input ? "input" : "output");
+        menu_create (vol, input);
+    }
+
+    if (input)
+    {
+        vol->menu_prefetch_idle = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
 /* Handler for menu click to open the profiles dialog */
 
 static void menu_open_profile_dialog (GtkWidget *, VolumePulsePlugin *vol)
@@ -425,12 +649,10 @@ static void menu_open_profile_dialog (GtkWidget *, VolumePulsePlugin *vol)
     profiles_dialog_show (vol);
 }
 
-/* Add a device entry to the menu */
+/* Create a device entry, which is added to the menu in alphabetical order when its section is complete */
 
 void menu_add_item (VolumePulsePlugin *vol, const char *label, const char *name, gboolean input)
 {
-    GList *list, *l;
-    int count;
     const char *disp_label = device_display_name (vol, label);
 
     GtkWidget *mi = gtk_check_menu_item_new_with_label (disp_label);
@@ -457,31 +679,47 @@ void menu_add_item (VolumePulsePlugin *vol, const char *label, const char *name,
         gtk_widget_set_sensitive (mi, FALSE);
     }
 
-    // find the start point of the last section - either a separator or the beginning of the list
-    list = gtk_container_get_children (GTK_CONTAINER (vol->menu_devices[input ? 1 : 0]));
-    count = g_list_length (list);
-    l = g_list_last (list);
-    while (l)
-    {
-        if (G_OBJECT_TYPE (l->data) == GTK_TYPE_SEPARATOR_MENU_ITEM) break;
-        count--;
-        l = l->prev;
-    }
+    // keep the collation key with the item, so that each label is only converted once when the section is sorted
+    g_object_set_data_full (G_OBJECT (mi), "collate_key", g_utf8_collate_key (disp_label, -1), g_free);
+    vol->menu_section = g_list_prepend (vol->menu_section, mi);
+    g_hash_table_insert (vol->menu_items[input ? 1 : 0], g_strdup (name), mi);
+}
 
-    // if l is NULL, init to element after start; if l is non-NULL, init to element after separator
-    if (!l) l = list;
-    else l = l->next;
+/* Find the device entry in the menu for an ALSA card, BlueZ path, or sink or source name */
 
-    // loop forward from the first element, comparing against the new label
-    while (l)
-    {
-        if (g_strcmp0 (disp_label, gtk_menu_item_get_label (GTK_MENU_ITEM (l->data))) < 0) break;
-        count++;
-        l = l->next;
-    }
+GtkWidget *menu_find_item (VolumePulsePlugin *vol, const char *name, gboolean input)
+{
+    if (!name || !vol->menu_items[input ? 1 : 0]) return NULL;
+    return g_hash_table_lookup (vol->menu_items[input ? 1 : 0], name);
+}
 
-    gtk_menu_shell_insert (GTK_MENU_SHELL (vol->menu_devices[input ? 1 : 0]), mi, count);
-    g_list_free (list);
+/* Change the device name of an entry in the menu, keeping the index in step */
+
+void menu_rename_item (VolumePulsePlugin *vol, GtkWidget *widget, const char *name, gboolean input)
+{
+    g_hash_table_remove (vol->menu_items[input ? 1 : 0], gtk_widget_get_name (widget));
+    gtk_widget_set_name (widget, name);
+    g_hash_table_insert (vol->menu_items[input ? 1 : 0], g_strdup (name), widget);
+}
+
+/* Compare two device entries by the collation keys of their labels */
+
+static gint menu_compare_items (gconstpointer a, gconstpointer b)
+{
+    return strcmp (g_object_get_data (G_OBJECT (a), "collate_key"), g_object_get_data (G_OBJECT (b), "collate_key"));
+}
+
+/* Sort the device entries created since the last section was added, and append them to the menu */
+
+static void menu_append_section (VolumePulsePlugin *vol, gboolean input_control)
+{
+    GList *l;
+
+    vol->menu_section = g_list_sort (vol->menu_section, menu_compare_items);
+    for (l = vol->menu_section; l != NULL; l = l->next)
+        gtk_menu_shell_append (GTK_MENU_SHELL (vol->menu_devices[input_control ? 1 : 0]), GTK_WIDGET (l->data));
+    g_list_free (vol->menu_section);
+    vol->menu_section = NULL;
 }
 
 /* Add a separator to the menu (but only if there isn't already one there...) */
@@ -506,42 +744,34 @@ void menu_add_separator (VolumePulsePlugin *vol, GtkWidget *menu)
     g_list_free (list);
 }
 
-/* Add a tickmark to the supplied widget if it is the default item in its parent menu */
+/*
+ * The default device is found in the menu by name for an ALSA device, or by its
+ * BlueZ path for a Bluetooth device, and the tickmark is moved from the entry which
+ * last had it; as activating an entry toggles its tickmark, the click handlers
+ * put it back until the server reports the new default.
+ */
 
-void menu_mark_default_output (GtkWidget *widget, gpointer data)
+static void menu_mark_default (VolumePulsePlugin *vol, gboolean input)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) data;
-    const char *def, *wid = gtk_widget_get_name (widget);
+    int index = input ? 1 : 0;
+    GtkWidget *mi = menu_find_item (vol, input ? vol->pa_default_source : vol->pa_default_sink, input);
 
-    def = vol->pa_default_sink;
-    if (!def || !wid) return;
+    if (!mi) mi = menu_find_item (vol, pulse_get_default_bluez_path (vol, input), input);
 
-    // check to see if either the two names match (for an ALSA device),
-    // or if the BlueZ address from the widget is in the default name */
-    if (!g_strcmp0 (def, wid) || (strstr (wid, "bluez") && strstr (def, wid + 20) && !strstr (def, "monitor")))
-    {
-        gulong hid = g_signal_handler_find (widget, G_SIGNAL_MATCH_ID, g_signal_lookup ("activate", GTK_TYPE_CHECK_MENU_ITEM), 0, NULL, NULL, NULL);
-        g_signal_handler_block (widget, hid);
-        gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (widget), TRUE);
-        g_signal_handler_unblock (widget, hid);
-    }
+    if (vol->menu_default[index] && vol->menu_default[index] != mi) menu_set_item_active (vol->menu_default[index], FALSE);
+    if (mi) menu_set_item_active (mi, TRUE);
+    vol->menu_default[index] = mi;
 }
 
-void menu_mark_default_input (GtkWidget *widget, gpointer data)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) data;
-    const char *def, *wid = gtk_widget_get_name (widget);
-
-    def = vol->pa_default_source;
-    if (!def || !wid) return;
+/* Set the tickmark on a menu entry without activating it */
 
-    // check to see if either the two names match (for an ALSA device),
-    // or if the BlueZ address from the widget is in the default name */
-    if (!g_strcmp0 (def, wid) || (strstr (wid, "bluez") && strstr (def, wid + 20) && !strstr (def, "monitor")))
+static void menu_set_item_active (GtkWidget *widget, gboolean active)
+{
+    if (gtk_check_menu_item_get_active (GTK_CHECK_MENU_ITEM (widget)) != active)
     {
         gulong hid = g_signal_handler_find (widget, G_SIGNAL_MATCH_ID, g_signal_lookup ("activate", GTK_TYPE_CHECK_MENU_ITEM), 0, NULL, NULL, NULL);
         g_signal_handler_block (widget, hid);
-        gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (widget), TRUE);
+        gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (widget), active);
         g_signal_handler_unblock (widget, hid);
     }
 }
@@ -550,14 +780,16 @@ void menu_mark_default_input (GtkWidget *widget, gpointer data)
 
 void menu_set_alsa_device_output (GtkWidget *widget, VolumePulsePlugin *vol)
 {
-    pulse_change_sink (vol, gtk_widget_get_name (widget));
+    menu_set_item_active (widget, widget == vol->menu_default[0]);
+    pulse_change_sink (vol, gtk_widget_get_name (widget), NULL, NULL);
     pulse_move_output_streams (vol);
     update_display (vol, FALSE);
 }
 
 void menu_set_alsa_device_input (GtkWidget *widget, VolumePulsePlugin *vol)
 {
-    pulse_change_source (vol, gtk_widget_get_name (widget));
+    menu_set_item_active (widget, widget == vol->menu_default[1]);
+    pulse_change_source (vol, gtk_widget_get_name (widget), NULL, NULL);
     pulse_move_input_streams (vol);
     update_display (vol, TRUE);
 }
@@ -566,11 +798,13 @@ void menu_set_alsa_device_input (GtkWidget *widget, VolumePulsePlugin *vol)
 
 void menu_set_bluetooth_device_output (GtkWidget *widget, VolumePulsePlugin *vol)
 {
+    menu_set_item_active (widget, widget == vol->menu_default[0]);
     bluetooth_set_output (vol, gtk_widget_get_name (widget), gtk_menu_item_get_label (GTK_MENU_ITEM (widget)));
 }
 
 void menu_set_bluetooth_device_input (GtkWidget *widget, VolumePulsePlugin *vol)
 {
+    menu_set_item_active (widget, widget == vol->menu_default[1]);
     bluetooth_set_input (vol, gtk_widget_get_name (widget), gtk_menu_item_get_label (GTK_MENU_ITEM (widget)));
 }
 
@@ -602,11 +836,12 @@ void profiles_dialog_show (VolumePulsePlugin *vol)
     gtk_box_pack_start (GTK_BOX (box), vol->profiles_ext_box, FALSE, FALSE, 0);
     gtk_box_pack_start (GTK_BOX (box), vol->profiles_bt_box, FALSE, FALSE, 0);
 
-    // first loop through cards
-    pulse_add_devices_to_profile_dialog (vol);
-
-    // then loop through Bluetooth devices
-    bluetooth_add_devices_to_profile_dialog (vol);
+    // show a placeholder until the devices are added, once the window has been drawn
+    wid = gtk_label_new (_("Reading devices..."));
+    gtk_widget_set_sensitive (wid, FALSE);
+    gtk_box_pack_start (GTK_BOX (vol->profiles_int_box), wid, FALSE, FALSE, 5);
+    vol->profiles_idle = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, profiles_dialog_fill, vol, NULL);
+    g_signal_connect (vol->profiles_dialog, "destroy", G_CALLBACK (profiles_dialog_destroyed), vol);
 
     wid = gtk_button_box_new (GTK_ORIENTATION_HORIZONTAL);
     gtk_button_box_set_layout (GTK_BUTTON_BOX (wid), GTK_BUTTONBOX_END);
@@ -619,19 +854,105 @@ void profiles_dialog_show (VolumePulsePlugin *vol)
     gtk_widget_show_all (vol->profiles_dialog);
 }
 
-/* Add a title and combo box to the profiles dialog */
+/* Reload the devices in the profiles dialog, if it is open, after a change on the server */
+
+void profiles_dialog_update (VolumePulsePlugin *vol)
+{
+    // settle the pending changes even with the dialog closed, so that a reopened dialog shows the model
+    if (vol->profiles_pending) g_hash_table_foreach_remove (vol->profiles_pending, profiles_dialog_confirm_profile, vol);
+
+    // nothing to do if the devices have not been added yet - they will be read from the model when they are
+    if (!vol->profiles_dialog || vol->profiles_idle) return;
+
+    gtk_container_foreach (GTK_CONTAINER (vol->profiles_int_box), (void *) gtk_widget_destroy, NULL);
+    gtk_container_foreach (GTK_CONTAINER (vol->profiles_ext_box), (void *) gtk_widget_destroy, NULL);
+    gtk_container_foreach (GTK_CONTAINER (vol->profiles_bt_box), (void *) gtk_widget_destroy, NULL);
+
+    profiles_dialog_add_devices (vol);
+
+    gtk_widget_show_all (vol->profiles_dialog);
+}
+
+/* Idle handler which replaces the placeholder in the profiles dialog with the devices */
+
+static gboolean profiles_dialog_fill (gpointer data)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) data;
+
+    vol->profiles_idle = 0;
+    profiles_dialog_update (vol);
+    return FALSE;
+}
+
+/* Handler for "destroy" signal from profiles dialog */
+
+static void profiles_dialog_destroyed (GtkWidget *, VolumePulsePlugin *vol)
+{
+    if (vol->profiles_idle) g_source_remove (vol->profiles_idle);
+    vol->profiles_idle = 0;
+}
+
+/*
+ * The rows for the cards and Bluetooth devices are collected into an array as
+ * they are created, then sorted once by the collation keys of their titles, and
+ * packed into their boxes in a single pass.
+ */
+
+static void profiles_dialog_add_devices (VolumePulsePlugin *vol)
+{
+    ProfilesRow *row;
+    guint i;
+
+    vol->profiles_rows = g_ptr_array_new_with_free_func (profiles_dialog_free_row);
+
+    // first loop through cards
+    pulse_add_devices_to_profile_dialog (vol);
+
+    // then loop through Bluetooth devices
+    bluetooth_add_devices_to_profile_dialog (vol);
+
+    g_ptr_array_sort (vol->profiles_rows, profiles_dialog_compare_rows);
+    for (i = 0; i < vol->profiles_rows->len; i++)
+    {
+        row = (ProfilesRow *) g_ptr_array_index (vol->profiles_rows, i);
+        gtk_box_pack_start (GTK_BOX (row->dest), row->label, FALSE, FALSE, 5);
+        gtk_box_pack_start (GTK_BOX (row->dest), row->combo, FALSE, FALSE, 5);
+    }
+
+    g_ptr_array_free (vol->profiles_rows, TRUE);
+    vol->profiles_rows = NULL;
+}
+
+/* Compare two rows of the profiles dialog by the collation keys of their titles */
+
+static gint profiles_dialog_compare_rows (gconstpointer a, gconstpointer b)
+{
+    return strcmp ((*(ProfilesRow **) a)->key, (*(ProfilesRow **) b)->key);
+}
+
+static void profiles_dialog_free_row (gpointer data)
+{
+    ProfilesRow *row = (ProfilesRow *) data;
+
+    g_free (row->key);
+    g_free (row);
+}
+
+/* Create a title and combo box for the profiles dialog, which are packed in order when all have been created */
 
 void profiles_dialog_add_combo (VolumePulsePlugin *vol, GtkListStore *ls, GtkWidget *dest, int sel, const char *label, const char *name)
 {
     GtkWidget *lbl, *comb;
     GtkCellRenderer *rend;
-    char *ltext;
+    GtkTreeIter iter;
+    ProfilesRow *row;
+    ProfilesPending *pending;
+    char *ltext, *option;
+    gboolean valid;
 
     ltext = g_strdup_printf ("%s:", device_display_name (vol, label));
     lbl = gtk_label_new (ltext);
     gtk_label_set_xalign (GTK_LABEL (lbl), 0.0);
-    gtk_box_pack_start (GTK_BOX (dest), lbl, FALSE, FALSE, 5);
-    g_free (ltext);
 
     if (ls)
     {
@@ -648,46 +969,101 @@ void profiles_dialog_add_combo (VolumePulsePlugin *vol, GtkListStore *ls, GtkWid
         gtk_widget_set_sensitive (comb, FALSE);
     }
     gtk_combo_box_set_active (GTK_COMBO_BOX (comb), sel);
-    gtk_box_pack_start (GTK_BOX (dest), comb, FALSE, FALSE, 5);
 
-    profiles_dialog_relocate_last_item (dest);
+    // hold the combo box on a profile which is being set
+    pending = ls && vol->profiles_pending ? g_hash_table_lookup (vol->profiles_pending, name) : NULL;
+    if (pending)
+    {
+        valid = gtk_tree_model_get_iter_first (GTK_TREE_MODEL (ls), &iter);
+        while (valid)
+        {
+            gtk_tree_model_get (GTK_TREE_MODEL (ls), &iter, 0, &option, -1);
+            if (!g_strcmp0 (option, pending->profile)) gtk_combo_box_set_active_iter (GTK_COMBO_BOX (comb), &iter);
+            g_free (option);
+            valid = gtk_tree_model_iter_next (GTK_TREE_MODEL (ls), &iter);
+        }
+        gtk_widget_set_sensitive (comb, FALSE);
+    }
 
     if (ls) g_signal_connect (comb, "changed", G_CALLBACK (profiles_dialog_combo_changed), vol);
+
+    row = g_new (ProfilesRow, 1);
+    row->dest = dest;
+    row->label = lbl;
+    row->combo = comb;
+    row->key = g_utf8_collate_key (ltext, -1);
+    g_ptr_array_add (vol->profiles_rows, row);
+    g_free (ltext);
 }
 
-/* Alphabetically relocate the last item added to the profiles dialog */
+/*
+ * Profile changes can take a second or more, so each is submitted without waiting
+ * for it and the combo box is held showing the new profile, greyed out, until the
+ * change is seen in the model - or set back to the model's profile if the change
+ * fails. The profiles being set are kept by card name, so that the pending state
+ * survives the dialog being reloaded, and several cards can change at once. Once
+ * a change has completed, the next card event settles it whatever the model then
+ * shows, and a change for a card which has left the model is dropped, so that a
+ * combo box is never held on a profile the server did not end up with.
+ */
 
-static void profiles_dialog_relocate_last_item (GtkWidget *box)
+static void profiles_dialog_combo_changed (GtkComboBox *combo, VolumePulsePlugin *vol)
 {
-    GtkWidget *elem, *newcomb, *newlab;
-    GList *children = gtk_container_get_children (GTK_CONTAINER (box));
-    int n = g_list_length (children);
-    newcomb = g_list_nth_data (children, n - 1);
-    newlab = g_list_nth_data (children, n - 2);
-    const char *new_item = gtk_label_get_text (GTK_LABEL (newlab));
-    n -= 2;
-    while (n > 0)
+    ProfilesPending *pending;
+    const char *name;
+    GtkTreeIter iter;
+
+    name = gtk_widget_get_name (GTK_WIDGET (combo));
+    pending = g_new0 (ProfilesPending, 1);
+    gtk_combo_box_get_active_iter (combo, &iter);
+    gtk_tree_model_get (gtk_combo_box_get_model (combo), &iter, 0, &pending->profile, -1);
+
+    if (!vol->profiles_pending) vol->profiles_pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, profiles_dialog_free_pending);
+    g_hash_table_insert (vol->profiles_pending, g_strdup (name), pending);
+    gtk_widget_set_sensitive (GTK_WIDGET (combo), FALSE);
+
+    if (!pulse_set_profile (vol, name, pending->profile, profiles_dialog_profile_set, g_strdup (name)))
+        profiles_dialog_profile_set (vol, FALSE, g_strdup (name));
+}
+
+/* Callback for completion of a profile change - rolls back the combo box on failure */
+
+static void profiles_dialog_profile_set (VolumePulsePlugin *vol, gboolean success, gpointer data)
+{
+    char *card = (char *) data;
+    ProfilesPending *pending = vol->profiles_pending ? g_hash_table_lookup (vol->profiles_pending, card) : NULL;
+    const char *profile = pulse_get_profile (vol, card);
+
+    if (pending)
     {
-        elem = g_list_nth_data (children, n - 2);
-        if (g_strcmp0 (new_item, gtk_label_get_text (GTK_LABEL (elem))) >= 0) break;
-        n -= 2;
+        // the model may already show the change, or may have lost the card; otherwise the next card event settles it
+        if (!success || !profile || !g_strcmp0 (pending->profile, profile))
+        {
+            if (!success) g_warning ("volumepulse: could not set profile %s on card %s", pending->profile, card);
+            g_hash_table_remove (vol->profiles_pending, card);
+            profiles_dialog_update (vol);
+        }
+        else pending->done = TRUE;
     }
-    gtk_box_reorder_child (GTK_BOX (box), newlab, n);
-    gtk_box_reorder_child (GTK_BOX (box), newcomb, n + 1);
-    g_list_free (children);
+    g_free (card);
 }
 
-/* Handler for "changed" signal from a profile combo box */
+/* Remove the profile changes which are settled - completed, shown in the model, or for a card no longer in it */
 
-static void profiles_dialog_combo_changed (GtkComboBox *combo, VolumePulsePlugin *vol)
+static gboolean profiles_dialog_confirm_profile (gpointer key, gpointer value, gpointer data)
 {
-    const char *name, *option;
-    GtkTreeIter iter;
+    ProfilesPending *pending = (ProfilesPending *) value;
+    const char *profile = pulse_get_profile ((VolumePulsePlugin *) data, (const char *) key);
 
-    name = gtk_widget_get_name (GTK_WIDGET (combo));
-    gtk_combo_box_get_active_iter (combo, &iter);
-    gtk_tree_model_get (gtk_combo_box_get_model (combo), &iter, 0, &option, -1);
-    pulse_set_profile (vol, name, option);
+    return pending->done || !profile || !g_strcmp0 (pending->profile, profile);
+}
+
+static void profiles_dialog_free_pending (gpointer data)
+{
+    ProfilesPending *pending = (ProfilesPending *) data;
+
+    g_free (pending->profile);
+    g_free (pending);
 }
 
 /* Handler for 'OK' button on profiles dialog */
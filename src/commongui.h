@@ -35,9 +35,17 @@ extern void close_widget (GtkWidget **wid);
 extern const char *device_display_name (VolumePulsePlugin *vol, const char *name);
 
 extern void update_display (VolumePulsePlugin *vol, gboolean input);
+extern void update_visibility (VolumePulsePlugin *vol, gboolean input);
+extern void invalidate_display (VolumePulsePlugin *vol);
 
 extern void menu_show (VolumePulsePlugin *vol, gboolean input);
+extern void menu_update (VolumePulsePlugin *vol, gboolean input);
+extern void menu_invalidate (VolumePulsePlugin *vol, gboolean input);
+extern void menu_prefetch (VolumePulsePlugin *vol);
+extern void menu_prefetch_cancel (VolumePulsePlugin *vol);
 extern void menu_add_item (VolumePulsePlugin *vol, const char *label, const char *name, gboolean input);
+extern GtkWidget *menu_find_item (VolumePulsePlugin *vol, const char *name, gboolean input);
+extern void menu_rename_item (VolumePulsePlugin *vol, GtkWidget *widget, const char *name, gboolean input);
 extern void menu_add_separator (VolumePulsePlugin *vol, GtkWidget *menu);
 extern void menu_set_alsa_device_output (GtkWidget *widget, VolumePulsePlugin *vol);
 extern void menu_set_bluetooth_device_output (GtkWidget *widget, VolumePulsePlugin *vol);
@@ -45,11 +53,13 @@ extern void menu_set_alsa_device_input (GtkWidget *widget, VolumePulsePlugin *vo
 extern void menu_set_bluetooth_device_input (GtkWidget *widget, VolumePulsePlugin *vol);
 
 extern void popup_window_show (VolumePulsePlugin *vol, gboolean input_control);
+extern void popup_window_free (VolumePulsePlugin *vol);
 
 extern void volumepulse_mouse_scrolled (GtkScale *scale, GdkEventScroll *evt, VolumePulsePlugin *vol);
 extern void micpulse_mouse_scrolled (GtkScale *scale, GdkEventScroll *evt, VolumePulsePlugin *vol);
 
 extern void profiles_dialog_show (VolumePulsePlugin *vol);
+extern void profiles_dialog_update (VolumePulsePlugin *vol);
 extern void profiles_dialog_add_combo (VolumePulsePlugin *vol, GtkListStore *ls, GtkWidget *dest, int sel, const char *label, const char *name);
 
 /* End of file */
@@ -45,98 +45,509 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 /*
  * Access to the controller is via asynchronous functions which request
- * information or settings. Because the plugin itself runs synchronously,
- * all controller access functions are wrapped in code which waits for
- * them to complete. Returned values, where appropriate, are written to
- * the plugin global data structure via callbacks from the async functions.
- * The macros below are the boilerplate around each async call.
+ * information or settings. None of these are waited for; instead, each
+ * request is wrapped in an operation record which is submitted to the
+ * controller thread. The controller callbacks copy any returned data into
+ * plain records attached to the operation, and when the request completes,
+ * the operation is posted back to the GLib main context, where its
+ * completion functions are called on the GTK thread. The macros below are
+ * the boilerplate around each async call.
  */
 
-#define START_PA_OPERATION \
+#define START_PA_OPERATION(done,cb,data) \
     pa_operation *op; \
+    PulseOp *paop; \
     if (!vol->pa_cont) return 0; \
-    if (vol->pa_error_msg) \
-    { \
-        g_free (vol->pa_error_msg); \
-        vol->pa_error_msg = NULL; \
-    } \
-    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    pa_threaded_mainloop_lock (vol->pa_mainloop); \
+    paop = pa_op_new (vol, done, cb, data);
 
 #define END_PA_OPERATION(name) \
     if (!op) \
     { \
+        vol->pa_ops = g_list_remove (vol->pa_ops, paop); \
+        pa_op_free (paop); \
         pa_threaded_mainloop_unlock (vol->pa_mainloop); \
         pa_error_handler (vol, name); \
         return 0; \
     } \
-    while (pa_operation_get_state (op) == PA_OPERATION_RUNNING) \
-    { \
-        pa_threaded_mainloop_wait (vol->pa_mainloop); \
-    } \
     pa_operation_unref (op); \
     pa_threaded_mainloop_unlock (vol->pa_mainloop); \
-    if (vol->pa_error_msg) return 0; \
-    else return 1;
-    
+    return 1;
+
 #define PA_VOL_SCALE 655    /* GTK volume scale is 0-100; PA scale is 0-65535 */
 
+/* Flags to show which parts of the model and display need to be updated after notifications */
+
+#define PA_DIRTY_CARDS      0x01
+#define PA_DIRTY_SINKS      0x02
+#define PA_DIRTY_SOURCES    0x04
+#define PA_DIRTY_SERVER     0x08
+#define PA_DIRTY_OUTPUT     0x10
+#define PA_DIRTY_INPUT      0x20
+#define PA_DIRTY_MENU_OUT   0x40
+#define PA_DIRTY_MENU_IN    0x80
+#define PA_DIRTY_PROFILES   0x100
+#define PA_DIRTY_VISIBLE    0x200
+#define PA_DIRTY_ALL        0x3FF
+
+/* Values in the change tables showing whether an object is to be re-read or removed from the model */
+
+#define PA_CHANGE_FETCH     1
+#define PA_CHANGE_REMOVE    2
+
+/* Subscription mask for the facilities which affect what the plugin shows */
+
+#define PA_SUBSCRIPTION_MASK (PA_SUBSCRIPTION_MASK_SINK | PA_SUBSCRIPTION_MASK_SOURCE | PA_SUBSCRIPTION_MASK_SERVER | PA_SUBSCRIPTION_MASK_CARD)
+
+typedef struct _PulseOp PulseOp;
+typedef void (*PulseOpDone) (PulseOp *paop);
+typedef pa_operation *(*PulseStreamOp) (VolumePulsePlugin *vol, uint32_t index, PulseOp *paop);
+
+/* An operation submitted to the controller */
+
+struct _PulseOp
+{
+    VolumePulsePlugin *vol;             /* Plugin which submitted the operation */
+    PulseOpDone done;                   /* Internal completion, called on GTK thread */
+    PulseCallback cb;                   /* Caller's completion, called on GTK thread after done */
+    gpointer cb_data;                   /* Data for caller's completion */
+    gboolean input;                     /* Flag to show if the operation is for input or output */
+    GList *results;                     /* Records copied from controller callbacks */
+    GDestroyNotify free_result;         /* Function to free each record in results */
+    char *error_msg;                    /* Error message from success / fail callback */
+    uint32_t index;                     /* Object index for single object queries */
+    guint idle_id;                      /* Source which posts completion to GTK thread */
+};
+
+/* Copy of the data for a stream */
+
+typedef struct
+{
+    uint32_t index;                     /* Sink input or source output index */
+    uint32_t device;                    /* Index of the sink or source the stream is connected to */
+    int mute;                           /* Mute setting */
+} PulseStream;
+
+/* The volume write state for a sink or source */
+
+typedef struct
+{
+    char *name;                         /* Sink or source name */
+    gboolean input;                     /* Flag to show if the device is a source */
+    int volume;                         /* Most recent volume requested */
+    gboolean in_flight;                 /* A write is waiting for the server to reply */
+    gboolean pending;                   /* The volume has changed since the write in flight was sent */
+} PulseVolumeWrite;
+
+/* A card, sink or source to be re-read after a notification */
+
+typedef struct
+{
+    pa_subscription_event_type_t facility;  /* Card, sink or source */
+    uint32_t index;                         /* Index of the object */
+} PulseChange;
+
+/* Copy of the data for a card */
+
+typedef struct
+{
+    uint32_t index;                     /* Card index */
+    char *name;                         /* Card name */
+    char *alsa_card;                    /* ALSA card number ("alsa.card") */
+    char *alsa_name;                    /* ALSA card name ("alsa.card_name") */
+    char *description;                  /* Device description */
+    char *form_factor;                  /* Device form factor */
+    char *api;                          /* Device API - alsa, bluez or bluez5 */
+    char *bluez_path;                   /* BlueZ object path ("bluez.path") */
+    gboolean has_input;                 /* Card has an input port */
+    gboolean has_output;                /* Card has an output port */
+    GList *profiles;                    /* Available profiles - list of PulseProfile */
+    char *active_profile;               /* Name of currently active profile */
+} PulseCard;
+
+typedef struct
+{
+    char *name;                         /* Profile name */
+    char *description;                  /* Profile description */
+} PulseProfile;
+
+/* Copy of the data for a sink or source */
+
+typedef struct
+{
+    uint32_t index;                     /* Sink or source index */
+    char *name;                         /* Sink or source name */
+    char *api;                          /* Device API - alsa, bluez or bluez5 */
+    char *alsa_card;                    /* ALSA card number ("alsa.card") */
+    char *bluez_path;                   /* BlueZ object path ("bluez.path") */
+    char *bt_protocol;                  /* Bluetooth protocol ("bluetooth.protocol") */
+    uint32_t monitor_of_sink;           /* Index of the sink monitored by a source, or PA_INVALID_INDEX */
+    int channels;                       /* Number of channels */
+    int volume;                         /* Volume of first channel */
+    int mute;                           /* Mute setting */
+} PulseDevice;
+
+/* Indices of the card, sink and source in the model for a BlueZ device */
+
+typedef struct
+{
+    uint32_t card;                      /* Card index, or PA_INVALID_INDEX */
+    uint32_t device[2];                 /* Sink and source indices, or PA_INVALID_INDEX */
+} PulseBluez;
+
 /*----------------------------------------------------------------------------*/
 /* Global data                                                                */
 /*----------------------------------------------------------------------------*/
 
+/*
+ * Routing table for notifications, indexed by facility and then by event type
+ * (new, change, remove), giving the parts of the display to update. The model
+ * is updated separately from the object index in the notification. Facilities
+ * not listed here are not subscribed to.
+ */
+
+static const guint pa_event_routes[PA_SUBSCRIPTION_EVENT_CARD + 1][3] =
+{
+    [PA_SUBSCRIPTION_EVENT_SINK] =
+    {
+        PA_DIRTY_OUTPUT | PA_DIRTY_MENU_OUT,
+        PA_DIRTY_OUTPUT,
+        PA_DIRTY_OUTPUT | PA_DIRTY_MENU_OUT
+    },
+    [PA_SUBSCRIPTION_EVENT_SOURCE] =
+    {
+        PA_DIRTY_INPUT | PA_DIRTY_MENU_IN,
+        PA_DIRTY_INPUT,
+        PA_DIRTY_INPUT | PA_DIRTY_MENU_IN
+    },
+    [PA_SUBSCRIPTION_EVENT_SERVER] =
+    {
+        0,
+        PA_DIRTY_SERVER | PA_DIRTY_OUTPUT | PA_DIRTY_INPUT,
+        0
+    },
+    [PA_SUBSCRIPTION_EVENT_CARD] =
+    {
+        PA_DIRTY_VISIBLE | PA_DIRTY_MENU_OUT | PA_DIRTY_MENU_IN | PA_DIRTY_PROFILES,
+        PA_DIRTY_VISIBLE | PA_DIRTY_MENU_OUT | PA_DIRTY_MENU_IN | PA_DIRTY_PROFILES,
+        PA_DIRTY_VISIBLE | PA_DIRTY_MENU_OUT | PA_DIRTY_MENU_IN | PA_DIRTY_PROFILES
+    },
+};
+
 /*----------------------------------------------------------------------------*/
 /* Prototypes                                                                 */
 /*----------------------------------------------------------------------------*/
 
+static PulseOp *pa_op_new (VolumePulsePlugin *vol, PulseOpDone done, PulseCallback cb, gpointer data);
+static void pa_op_complete (PulseOp *paop);
+static gboolean pa_op_dispatch (gpointer userdata);
+static void pa_op_free (gpointer data);
+static int pa_run_batch (VolumePulsePlugin *vol, GList *indices, PulseStreamOp submit, const char *name);
+static void pa_done_batch (PulseOp *paop);
+static PulseCard *pa_card_new (const pa_card_info *i);
+static void pa_card_free (gpointer data);
+static void pa_profile_free (gpointer data);
+static PulseDevice *pa_sink_new (const pa_sink_info *i);
+static PulseDevice *pa_source_new (const pa_source_info *i);
+static void pa_device_free (gpointer data);
 static void pa_cb_state (pa_context *pacontext, void *userdata);
+static void pa_done_connected (PulseOp *paop);
+static void pa_cb_init_model (VolumePulsePlugin *vol, gboolean success, gpointer data);
 static void pa_error_handler (VolumePulsePlugin *vol, char *name);
 static int pa_set_subscription (VolumePulsePlugin *vol);
 static void pa_cb_subscription (pa_context *pacontext, pa_subscription_event_type_t event, uint32_t idx, void *userdata);
+static GHashTable *pa_change_table (VolumePulsePlugin *vol, guint facility);
 static gboolean pa_update_disp_cb (gpointer userdata);
+static GList *pa_apply_changes (VolumePulsePlugin *vol, GHashTable *changes, guint facility);
+static void pa_cb_model_updated (VolumePulsePlugin *vol, gboolean success, gpointer data);
 static void pa_cb_generic_success (pa_context *context, int success, void *userdata);
-static int pa_get_current_vol_mute (VolumePulsePlugin *vol, gboolean input_control);
-static void pa_cb_get_current_vol_mute (pa_context *context, const pa_sink_info *i, int eol, void *userdata);
-static void pa_cb_get_current_input_vol_mute (pa_context *context, const pa_source_info *i, int eol, void *userdata);
-static int pa_get_channels (VolumePulsePlugin *vol);
-static void pa_cb_get_channels (pa_context *context, const pa_sink_info *i, int eol, void *userdata);
-static int pa_restore_volume (VolumePulsePlugin *vol);
-static int pa_restore_mute (VolumePulsePlugin *vol);
+static void pa_cb_get_cards (pa_context *context, const pa_card_info *i, int eol, void *userdata);
+static void pa_cb_get_sinks (pa_context *context, const pa_sink_info *i, int eol, void *userdata);
+static void pa_cb_get_sources (pa_context *context, const pa_source_info *i, int eol, void *userdata);
+static void pa_cb_batch_success (pa_context *context, int success, void *userdata);
+static int pa_update_model (VolumePulsePlugin *vol, guint dirty, GList *changes, PulseCallback cb, gpointer data);
+static int pa_get_cards (VolumePulsePlugin *vol, PulseCallback cb, gpointer data);
+static int pa_get_sinks (VolumePulsePlugin *vol, PulseCallback cb, gpointer data);
+static int pa_get_sources (VolumePulsePlugin *vol, PulseCallback cb, gpointer data);
+static void pa_done_get_cards (PulseOp *paop);
+static void pa_done_get_sinks (PulseOp *paop);
+static void pa_done_get_sources (PulseOp *paop);
+static void pa_replace_records (GHashTable *table, PulseOp *paop);
+static int pa_get_by_index (VolumePulsePlugin *vol, PulseChange *change, PulseCallback cb, gpointer data);
+static void pa_done_get_card_by_index (PulseOp *paop);
+static void pa_done_get_sink_by_index (PulseOp *paop);
+static void pa_done_get_source_by_index (PulseOp *paop);
+static void pa_replace_record (GHashTable *table, PulseOp *paop);
+static void pa_count_card (VolumePulsePlugin *vol, PulseCard *card, int delta);
+static void pa_index_bluez (VolumePulsePlugin *vol, guint facility, gpointer record, int delta);
+static void pa_index_bluez_table (VolumePulsePlugin *vol, guint facility, int delta);
+static uint32_t *pa_bluez_slot (PulseBluez *entry, guint facility);
+static PulseBluez *pa_find_bluez (VolumePulsePlugin *vol, const char *path);
+static int pa_get_default_sink_source (VolumePulsePlugin *vol, PulseCallback cb, gpointer data);
 static void pa_cb_get_default_sink_source (pa_context *context, const pa_server_info *i, void *userdata);
-static int pa_set_default_sink (VolumePulsePlugin *vol, const char *sinkname);
-static int pa_get_output_streams (VolumePulsePlugin *vol);
+static void pa_done_get_default_sink_source (PulseOp *paop);
+static PulseDevice *pa_find_device (GHashTable *table, const char *name);
+static PulseCard *pa_find_card (VolumePulsePlugin *vol, const char *name);
+static PulseDevice *pa_default_device (VolumePulsePlugin *vol, gboolean input_control);
+static int pa_write_volume (VolumePulsePlugin *vol, PulseDevice *dev, gboolean input_control);
+static int pa_submit_volume (VolumePulsePlugin *vol, PulseVolumeWrite *write);
+static int pa_send_volume (VolumePulsePlugin *vol, PulseVolumeWrite *write, const pa_cvolume *cvol);
+static void pa_cb_volume_written (VolumePulsePlugin *vol, gboolean success, gpointer data);
+static void pa_keep_written_volume (VolumePulsePlugin *vol, PulseDevice *dev);
+static void pa_volume_write_free (gpointer data);
+static int pa_restore_volume (VolumePulsePlugin *vol, int volume);
+static int pa_restore_mute (VolumePulsePlugin *vol, int mute);
+static int pa_set_default_sink (VolumePulsePlugin *vol, const char *sinkname, PulseCallback cb, gpointer data);
+static int pa_get_output_streams (VolumePulsePlugin *vol, PulseOpDone done);
 static void pa_cb_get_output_streams (pa_context *context, const pa_sink_input_info *i, int eol, void *userdata);
-static void pa_list_move_to_default_sink (gpointer data, gpointer userdata);
-static int pa_move_stream_to_default_sink (VolumePulsePlugin *vol, int index);
-static int pa_set_default_source (VolumePulsePlugin *vol, const char *sourcename);
-static int pa_get_input_streams (VolumePulsePlugin *vol);
+static void pa_done_move_output_streams (PulseOp *paop);
+static pa_operation *pa_move_stream_to_default_sink (VolumePulsePlugin *vol, uint32_t index, PulseOp *paop);
+static int pa_set_default_source (VolumePulsePlugin *vol, const char *sourcename, PulseCallback cb, gpointer data);
+static int pa_get_input_streams (VolumePulsePlugin *vol, PulseOpDone done);
 static void pa_cb_get_input_streams (pa_context *context, const pa_source_output_info *i, int eol, void *userdata);
-static void pa_list_move_to_default_source (gpointer data, gpointer userdata);
-static int pa_move_stream_to_default_source (VolumePulsePlugin *vol, int index);
-static void pa_list_mute_stream (gpointer data, gpointer userdata);
-static int pa_mute_stream (VolumePulsePlugin *vol, int index);
-static void pa_list_unmute_stream (gpointer data, gpointer userdata);
-static int pa_unmute_stream (VolumePulsePlugin *vol, int index);
-static void pa_cb_get_profile (pa_context *c, const pa_card_info *i, int eol, void *userdata);
-static void pa_cb_get_info_inputs (pa_context *c, const pa_card_info *i, int eol, void *userdata);
-static void pa_cb_get_info_internal (pa_context *c, const pa_card_info *i, int eol, void *userdata);
-static void pa_cb_get_info_external (pa_context *c, const pa_card_info *i, int eol, void *userdata);
+static void pa_done_move_input_streams (PulseOp *paop);
+static pa_operation *pa_move_stream_to_default_source (VolumePulsePlugin *vol, uint32_t index, PulseOp *paop);
+static void pa_done_mute_all_streams (PulseOp *paop);
+static pa_operation *pa_mute_stream (VolumePulsePlugin *vol, uint32_t index, PulseOp *paop);
+static void pa_done_unmute_all_streams (PulseOp *paop);
+static pa_operation *pa_unmute_stream (VolumePulsePlugin *vol, uint32_t index, PulseOp *paop);
+static GList *pa_select_streams (GList *streams, gboolean (*select) (PulseStream *stream, uint32_t device), uint32_t device);
+static gboolean pa_stream_not_on_device (PulseStream *stream, uint32_t device);
+static gboolean pa_stream_unmuted (PulseStream *stream, uint32_t device);
+static gboolean pa_stream_muted (PulseStream *stream, uint32_t device);
 static gboolean pa_card_has_port (const pa_card_info *i, pa_direction_t dir);
-static int pa_replace_cards_with_sinks (VolumePulsePlugin *vol);
-static void pa_cb_replace_cards_with_sinks (pa_context *context, const pa_sink_info *i, int eol, void *userdata);
-static void pa_replace_card_with_sink_on_match (GtkWidget *widget, gpointer data);
-static void pa_card_check_bt_output_profile (GtkWidget *widget, gpointer data);
-static int pa_replace_cards_with_sources (VolumePulsePlugin *vol);
-static void pa_cb_replace_cards_with_sources (pa_context *context, const pa_source_info *i, int eol, void *userdata);
-static void pa_replace_card_with_source_on_match (GtkWidget *widget, gpointer data);
-static void pa_card_check_bt_input_profile (GtkWidget *widget, gpointer data);
-static void pa_cb_add_devices_to_profile_dialog (pa_context *c, const pa_card_info *i, int eol, void *userdata);
-static void pa_cb_count_inputs (pa_context *c, const pa_card_info *i, int eol, void *userdata);
-static void pa_cb_count_outputs (pa_context *c, const pa_card_info *i, int eol, void *userdata);
+static gint pa_compare_devices (gconstpointer a, gconstpointer b);
+static void pa_replace_card_with_device (VolumePulsePlugin *vol, GtkWidget *widget, PulseDevice *dev, gboolean input_control);
+static void pa_card_check_bt_profile (GtkWidget *widget, PulseDevice *dev, gboolean input_control);
 
 /*----------------------------------------------------------------------------*/
 /* Function definitions                                                       */
 /*----------------------------------------------------------------------------*/
 
+/*----------------------------------------------------------------------------*/
+/* Operations                                                                 */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Operations are created with the mainloop lock held, and are listed in the
+ * plugin data structure until their completion has been delivered, so that
+ * any which are outstanding when the controller is torn down can be freed
+ * without their completions being called.
+ */
+
+static PulseOp *pa_op_new (VolumePulsePlugin *vol, PulseOpDone done, PulseCallback cb, gpointer data)
+{
+    PulseOp *paop = g_new0 (PulseOp, 1);
+
+    paop->vol = vol;
+    paop->done = done;
+    paop->cb = cb;
+    paop->cb_data = data;
+    vol->pa_ops = g_list_prepend (vol->pa_ops, paop);
+    return paop;
+}
+
+/* Called on the controller thread when an operation has finished - posts it to the GTK thread */
+
+static void pa_op_complete (PulseOp *paop)
+{
+    paop->idle_id = g_idle_add (pa_op_dispatch, paop);
+}
+
+/* Called on the GTK thread to run the completion functions for an operation */
+
+static gboolean pa_op_dispatch (gpointer userdata)
+{
+    PulseOp *paop = (PulseOp *) userdata;
+    VolumePulsePlugin *vol = paop->vol;
+
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    vol->pa_ops = g_list_remove (vol->pa_ops, paop);
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    paop->idle_id = 0;
+
+    if (vol->pa_error_msg) g_free (vol->pa_error_msg);
+    vol->pa_error_msg = g_strdup (paop->error_msg);
+
+    if (paop->done) paop->done (paop);
+    if (paop->cb) paop->cb (vol, paop->error_msg == NULL, paop->cb_data);
+
+    pa_op_free (paop);
+    return FALSE;
+}
+
+static void pa_op_free (gpointer data)
+{
+    PulseOp *paop = (PulseOp *) data;
+
+    if (paop->idle_id) g_source_remove (paop->idle_id);
+    if (paop->free_result) g_list_free_full (paop->results, paop->free_result);
+    else g_list_free (paop->results);
+    g_free (paop->error_msg);
+    g_free (paop);
+}
+
+/*
+ * A batch runs the same operation on a list of streams. All the operations are
+ * submitted in a single hold of the mainloop lock, so are sent to the server back
+ * to back, and share a single operation record which completes when the last of
+ * them has replied. The server replies in order, so the head of the list of
+ * indices in the results is the stream each reply is for, and is removed as the
+ * reply arrives; failures are reported per stream. The list of indices is taken
+ * over by the batch.
+ */
+
+static int pa_run_batch (VolumePulsePlugin *vol, GList *indices, PulseStreamOp submit, const char *name)
+{
+    pa_operation *op;
+    PulseOp *paop;
+    GList *l;
+
+    if (!indices) return 1;
+    if (!vol->pa_cont)
+    {
+        g_list_free (indices);
+        return 0;
+    }
+
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    paop = pa_op_new (vol, pa_done_batch, NULL, NULL);
+    paop->results = indices;
+    for (l = indices; l != NULL; l = l->next)
+    {
+        op = submit (vol, GPOINTER_TO_UINT (l->data), paop);
+        if (!op)
+        {
+            pa_threaded_mainloop_unlock (vol->pa_mainloop);
+            pa_error_handler (vol, (char *) name);
+            return 0;
+        }
+        pa_operation_unref (op);
+    }
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    return 1;
+}
+
+/* Completion for a batch - logs any streams which failed */
+
+static void pa_done_batch (PulseOp *paop)
+{
+    if (paop->error_msg) g_warning ("%s", paop->error_msg);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Records                                                                    */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The info structures passed to controller callbacks are only valid for the
+ * duration of the callback, so the fields which the plugin uses are copied
+ * into records which can be passed to the GTK thread.
+ */
+
+static PulseCard *pa_card_new (const pa_card_info *i)
+{
+    PulseCard *card = g_new0 (PulseCard, 1);
+    pa_card_profile_info2 **profile = i->profiles2;
+
+    card->index = i->index;
+    card->name = g_strdup (i->name);
+    card->alsa_card = g_strdup (pa_proplist_gets (i->proplist, "alsa.card"));
+    card->alsa_name = g_strdup (pa_proplist_gets (i->proplist, "alsa.card_name"));
+    card->description = g_strdup (pa_proplist_gets (i->proplist, "device.description"));
+    card->form_factor = g_strdup (pa_proplist_gets (i->proplist, "device.form_factor"));
+    card->api = g_strdup (pa_proplist_gets (i->proplist, "device.api"));
+    card->bluez_path = g_strdup (pa_proplist_gets (i->proplist, "bluez.path"));
+    card->has_input = pa_card_has_port (i, PA_DIRECTION_INPUT);
+    card->has_output = pa_card_has_port (i, PA_DIRECTION_OUTPUT);
+    if (i->active_profile2) card->active_profile = g_strdup (i->active_profile2->name);
+
+    while (profile && *profile)
+    {
+        PulseProfile *prof = g_new0 (PulseProfile, 1);
+        prof->name = g_strdup ((*profile)->name);
+        prof->description = g_strdup ((*profile)->description);
+        card->profiles = g_list_append (card->profiles, prof);
+        profile++;
+    }
+    return card;
+}
+
+static void pa_card_free (gpointer data)
+{
+    PulseCard *card = (PulseCard *) data;
+
+    g_free (card->name);
+    g_free (card->alsa_card);
+    g_free (card->alsa_name);
+    g_free (card->description);
+    g_free (card->form_factor);
+    g_free (card->api);
+    g_free (card->bluez_path);
+    g_free (card->active_profile);
+    g_list_free_full (card->profiles, pa_profile_free);
+    g_free (card);
+}
+
+static void pa_profile_free (gpointer data)
+{
+    PulseProfile *prof = (PulseProfile *) data;
+
+    g_free (prof->name);
+    g_free (prof->description);
+    g_free (prof);
+}
+
+static PulseDevice *pa_sink_new (const pa_sink_info *i)
+{
+    PulseDevice *dev = g_new0 (PulseDevice, 1);
+
+    dev->index = i->index;
+    dev->name = g_strdup (i->name);
+    dev->api = g_strdup (pa_proplist_gets (i->proplist, "device.api"));
+    dev->alsa_card = g_strdup (pa_proplist_gets (i->proplist, "alsa.card"));
+    dev->bluez_path = g_strdup (pa_proplist_gets (i->proplist, "bluez.path"));
+    dev->bt_protocol = g_strdup (pa_proplist_gets (i->proplist, "bluetooth.protocol"));
+    dev->monitor_of_sink = PA_INVALID_INDEX;
+    dev->channels = i->volume.channels;
+    dev->volume = i->volume.values[0];
+    dev->mute = i->mute;
+    return dev;
+}
+
+static PulseDevice *pa_source_new (const pa_source_info *i)
+{
+    PulseDevice *dev = g_new0 (PulseDevice, 1);
+
+    dev->index = i->index;
+    dev->name = g_strdup (i->name);
+    dev->api = g_strdup (pa_proplist_gets (i->proplist, "device.api"));
+    dev->alsa_card = g_strdup (pa_proplist_gets (i->proplist, "alsa.card"));
+    // monitors copy the properties of their sink, so would be taken for the Bluetooth source
+    if (i->monitor_of_sink == PA_INVALID_INDEX)
+    {
+        dev->bluez_path = g_strdup (pa_proplist_gets (i->proplist, "bluez.path"));
+        dev->bt_protocol = g_strdup (pa_proplist_gets (i->proplist, "bluetooth.protocol"));
+    }
+    dev->monitor_of_sink = i->monitor_of_sink;
+    dev->channels = i->volume.channels;
+    dev->volume = i->volume.values[0];
+    dev->mute = i->mute;
+    return dev;
+}
+
+static void pa_device_free (gpointer data)
+{
+    PulseDevice *dev = (PulseDevice *) data;
+
+    g_free (dev->name);
+    g_free (dev->api);
+    g_free (dev->alsa_card);
+    g_free (dev->bluez_path);
+    g_free (dev->bt_protocol);
+    g_free (dev);
+}
+
 /*----------------------------------------------------------------------------*/
 /* PulseAudio controller initialisation / teardown                            */
 /*----------------------------------------------------------------------------*/
@@ -157,6 +568,21 @@ void pulse_init (VolumePulsePlugin *vol)
 
     vol->pa_cont = NULL;
     vol->pa_idle_timer = 0;
+    vol->analog_disabled = vsystem ("raspi-config nonint has_analog") ? TRUE : FALSE;
+    vol->pa_dirty = 0;
+    vol->pa_ops = NULL;
+    vol->pa_default_sink = NULL;
+    vol->pa_default_source = NULL;
+    vol->pa_count[0] = 0;
+    vol->pa_count[1] = 0;
+    vol->pa_cards = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, pa_card_free);
+    vol->pa_sinks = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, pa_device_free);
+    vol->pa_sources = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, pa_device_free);
+    vol->pa_bluez = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    vol->pa_card_changes = g_hash_table_new (g_direct_hash, g_direct_equal);
+    vol->pa_sink_changes = g_hash_table_new (g_direct_hash, g_direct_equal);
+    vol->pa_source_changes = g_hash_table_new (g_direct_hash, g_direct_equal);
+    vol->pa_volume_writes = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, pa_volume_write_free);
     vol->pa_mainloop = pa_threaded_mainloop_new ();
     pa_threaded_mainloop_start (vol->pa_mainloop);
 
@@ -178,15 +604,36 @@ void pulse_init (VolumePulsePlugin *vol)
 
     vol->pa_state = PA_CONTEXT_UNCONNECTED;
 
+    /* the rest of the initialisation is done when the connection completes */
+    vol->pa_connect_op = pa_op_new (vol, pa_done_connected, NULL, NULL);
+
     pa_context_set_state_callback (vol->pa_cont, &pa_cb_state, vol);
     pa_context_connect (vol->pa_cont, NULL, PA_CONTEXT_NOAUTOSPAWN, NULL);
 
-    while (vol->pa_state != PA_CONTEXT_READY && vol->pa_state != PA_CONTEXT_FAILED)
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+}
+
+/* Callback for changes in context state during initialisation */
+
+static void pa_cb_state (pa_context *pacontext, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (pacontext == NULL) vol->pa_state = PA_CONTEXT_FAILED;
+    else vol->pa_state = pa_context_get_state (pacontext);
+
+    if (vol->pa_connect_op && (vol->pa_state == PA_CONTEXT_READY || !PA_CONTEXT_IS_GOOD (vol->pa_state)))
     {
-        pa_threaded_mainloop_wait (vol->pa_mainloop);
+        pa_op_complete ((PulseOp *) vol->pa_connect_op);
+        vol->pa_connect_op = NULL;
     }
+}
 
-    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+/* Completion for the connection to the server - sets up subscription and reads initial state */
+
+static void pa_done_connected (PulseOp *paop)
+{
+    VolumePulsePlugin *vol = paop->vol;
 
     if (vol->pa_state != PA_CONTEXT_READY)
     {
@@ -194,46 +641,35 @@ void pulse_init (VolumePulsePlugin *vol)
         return;
     }
 
-    vol->pa_default_sink = NULL;
-    vol->pa_default_source = NULL;
-    vol->pa_profile = NULL;
-    vol->pa_indices = NULL;
-
     pa_set_subscription (vol);
-    pulse_get_default_sink_source (vol);
-    pulse_move_output_streams (vol);
-    pulse_move_input_streams (vol);
+    pa_update_model (vol, PA_DIRTY_ALL, NULL, pa_cb_init_model, NULL);
 }
 
-/* Callback for changes in context state during initialisation */
+/* Callback for initial read of the local model - moves streams to the default devices and prebuilds the menus */
 
-static void pa_cb_state (pa_context *pacontext, void *userdata)
+static void pa_cb_init_model (VolumePulsePlugin *vol, gboolean, gpointer)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    if (pacontext == NULL)
-    {
-        vol->pa_state = PA_CONTEXT_FAILED;
-        pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
-        return;
-    }
-
-    vol->pa_state = pa_context_get_state (pacontext);
-
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    pulse_move_output_streams (vol);
+    pulse_move_input_streams (vol);
+    volumepulse_update_display (vol);
+    menu_prefetch (vol);
 }
 
 /* Teardown PulseAudio controller */
 
 void pulse_terminate (VolumePulsePlugin *vol)
 {
-    if (vol->pa_idle_timer) g_source_remove (vol->pa_idle_timer);
+    /* The menus are built from the model, so do not prefetch them once it is going */
+    menu_prefetch_cancel (vol);
+
     if (vol->pa_mainloop != NULL)
     {
         /* Disconnect the controller context */
         if (vol->pa_cont != NULL)
         {
             pa_threaded_mainloop_lock (vol->pa_mainloop);
+            pa_context_set_state_callback (vol->pa_cont, NULL, NULL);
+            pa_context_set_subscribe_callback (vol->pa_cont, NULL, NULL);
             pa_context_disconnect (vol->pa_cont);
             pa_context_unref (vol->pa_cont);
             vol->pa_cont = NULL;
@@ -243,7 +679,38 @@ void pulse_terminate (VolumePulsePlugin *vol)
         /* Terminate the control loop */
         pa_threaded_mainloop_stop (vol->pa_mainloop);
         pa_threaded_mainloop_free (vol->pa_mainloop);
+        vol->pa_mainloop = NULL;
     }
+
+    /* The controller thread has stopped, so nothing else can queue a refresh or a completion */
+    if (vol->pa_idle_timer) g_source_remove (vol->pa_idle_timer);
+    vol->pa_idle_timer = 0;
+    vol->pa_dirty = 0;
+    if (vol->pa_card_changes) g_hash_table_destroy (vol->pa_card_changes);
+    if (vol->pa_sink_changes) g_hash_table_destroy (vol->pa_sink_changes);
+    if (vol->pa_source_changes) g_hash_table_destroy (vol->pa_source_changes);
+    vol->pa_card_changes = NULL;
+    vol->pa_sink_changes = NULL;
+    vol->pa_source_changes = NULL;
+
+    /* Discard any completions not yet delivered */
+    g_list_free_full (vol->pa_ops, pa_op_free);
+    vol->pa_ops = NULL;
+    vol->pa_connect_op = NULL;
+
+    /* Discard the volume writes, which operations refer to, and the local model */
+    if (vol->pa_volume_writes) g_hash_table_destroy (vol->pa_volume_writes);
+    vol->pa_volume_writes = NULL;
+    if (vol->pa_cards) g_hash_table_destroy (vol->pa_cards);
+    if (vol->pa_sinks) g_hash_table_destroy (vol->pa_sinks);
+    if (vol->pa_sources) g_hash_table_destroy (vol->pa_sources);
+    if (vol->pa_bluez) g_hash_table_destroy (vol->pa_bluez);
+    vol->pa_cards = NULL;
+    vol->pa_sinks = NULL;
+    vol->pa_sources = NULL;
+    vol->pa_bluez = NULL;
+    vol->pa_count[0] = 0;
+    vol->pa_count[1] = 0;
 }
 
 /* Handler for unrecoverable errors - terminates the controller */
@@ -267,75 +734,609 @@ static void pa_error_handler (VolumePulsePlugin *vol, char *name)
 static int pa_set_subscription (VolumePulsePlugin *vol)
 {
     pa_context_set_subscribe_callback (vol->pa_cont, &pa_cb_subscription, vol);
-    START_PA_OPERATION
-    op = pa_context_subscribe (vol->pa_cont, PA_SUBSCRIPTION_MASK_ALL, &pa_cb_generic_success, vol);
+    START_PA_OPERATION (NULL, NULL, NULL)
+    op = pa_context_subscribe (vol->pa_cont, PA_SUBSCRIPTION_MASK, &pa_cb_generic_success, paop);
     END_PA_OPERATION ("subscribe")
 }
 
+/*
+ * Notifications are collected as a set of flags showing which parts of the display
+ * need to be updated, and a table for each of cards, sinks and sources of the
+ * indices which have changed or been removed. The first notification after an
+ * update queues an idle callback; any which arrive before it runs just add to the
+ * flags and tables, so a burst of notifications results in a single update which
+ * only re-reads the objects which changed. The flags, tables and the idle source
+ * ID are shared with the controller thread, so are only accessed with the
+ * mainloop lock held.
+ */
+
 /* Callback for notifications from the Pulse server */
 
-static void pa_cb_subscription (pa_context *, pa_subscription_event_type_t event, uint32_t, void *userdata)
+static void pa_cb_subscription (pa_context *, pa_subscription_event_type_t event, uint32_t idx, void *userdata)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
 
-    const char *fac, *type;
-    int newcard = 0;
+    guint facility = event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
+    guint type = (event & PA_SUBSCRIPTION_EVENT_TYPE_MASK) >> 4;
+    GHashTable *changes;
+    guint dirty;
 
-    switch (event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK)
-    {
-        case PA_SUBSCRIPTION_EVENT_SINK : fac = "sink"; break;
-        case PA_SUBSCRIPTION_EVENT_SOURCE : fac = "source"; break;
-        case PA_SUBSCRIPTION_EVENT_SINK_INPUT : fac = "sink input"; break;
-        case PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT : fac = "source output"; break;
-        case PA_SUBSCRIPTION_EVENT_MODULE : fac = "module"; break;
-        case PA_SUBSCRIPTION_EVENT_CLIENT : fac = "client"; break;
-        case PA_SUBSCRIPTION_EVENT_SAMPLE_CACHE : fac = "sample cache"; break;
-        case PA_SUBSCRIPTION_EVENT_SERVER : fac = "server"; break;
-        case PA_SUBSCRIPTION_EVENT_CARD : fac = "card"; newcard++; break;
-        default : fac = "unknown";
-    }
-    switch (event & PA_SUBSCRIPTION_EVENT_TYPE_MASK)
-    {
-        case PA_SUBSCRIPTION_EVENT_NEW : type = "New"; newcard++; break;
-        case PA_SUBSCRIPTION_EVENT_CHANGE : type = "Change"; break;
-        case PA_SUBSCRIPTION_EVENT_REMOVE : type = "Remove"; break;
-        default : type = "unknown";
-    }
+    if (facility > PA_SUBSCRIPTION_EVENT_CARD || type > 2) return;
+    dirty = pa_event_routes[facility][type];
 
 #ifdef DEBUG_ON
-    DEBUG ("PulseAudio event : %s %s", type, fac);
+    DEBUG ("PulseAudio event : facility %d type %d index %d dirty %02x", facility, type, idx, dirty);
 #endif
-    if (vol->bt_card_found == FALSE && newcard) vol->bt_card_found = TRUE;
+    // note the object to re-read or remove - a later event for the same object replaces an earlier one
+    changes = pa_change_table (vol, facility);
+    if (changes && idx != PA_INVALID_INDEX)
+    {
+        g_hash_table_insert (changes, GUINT_TO_POINTER (idx),
+            GUINT_TO_POINTER ((event & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE ? PA_CHANGE_REMOVE : PA_CHANGE_FETCH));
+    }
+    else if (!dirty) return;
 
-    vol->pa_idle_timer = g_idle_add (pa_update_disp_cb, vol);
+    vol->pa_dirty |= dirty;
+    if (!vol->pa_idle_timer) vol->pa_idle_timer = g_idle_add (pa_update_disp_cb, vol);
+}
+
+/* Get the table of changed objects for a facility */
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+static GHashTable *pa_change_table (VolumePulsePlugin *vol, guint facility)
+{
+    switch (facility)
+    {
+        case PA_SUBSCRIPTION_EVENT_CARD :   return vol->pa_card_changes;
+        case PA_SUBSCRIPTION_EVENT_SINK :   return vol->pa_sink_changes;
+        case PA_SUBSCRIPTION_EVENT_SOURCE : return vol->pa_source_changes;
+        default :                           return NULL;
+    }
 }
 
-/* Function to update display called when idle after a notification - needs not to be in main loop  */
+/* Function to update model called when idle after notifications - needs not to be in main loop  */
 
 static gboolean pa_update_disp_cb (gpointer userdata)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    GList *changes = NULL;
+    guint dirty;
 
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    dirty = vol->pa_dirty;
+    vol->pa_dirty = 0;
     vol->pa_idle_timer = 0;
-    volumepulse_update_display (vol);
+    changes = g_list_concat (changes, pa_apply_changes (vol, vol->pa_card_changes, PA_SUBSCRIPTION_EVENT_CARD));
+    changes = g_list_concat (changes, pa_apply_changes (vol, vol->pa_sink_changes, PA_SUBSCRIPTION_EVENT_SINK));
+    changes = g_list_concat (changes, pa_apply_changes (vol, vol->pa_source_changes, PA_SUBSCRIPTION_EVENT_SOURCE));
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+
+    DEBUG ("pa_update_disp_cb %02x", dirty);
+    pa_update_model (vol, dirty, changes, pa_cb_model_updated, GUINT_TO_POINTER (dirty));
+    g_list_free_full (changes, g_free);
     return FALSE;
 }
 
+/*
+ * Empty a table of changed objects - removed objects are deleted from the model
+ * straight away, and a list of the objects which need to be re-read is returned
+ */
+
+static GList *pa_apply_changes (VolumePulsePlugin *vol, GHashTable *changes, guint facility)
+{
+    GHashTable *table = facility == PA_SUBSCRIPTION_EVENT_CARD ? vol->pa_cards
+        : (facility == PA_SUBSCRIPTION_EVENT_SINK ? vol->pa_sinks : vol->pa_sources);
+    GList *fetch = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, changes);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        if (GPOINTER_TO_UINT (value) == PA_CHANGE_REMOVE)
+        {
+            if (facility == PA_SUBSCRIPTION_EVENT_CARD) pa_count_card (vol, g_hash_table_lookup (table, key), -1);
+            pa_index_bluez (vol, facility, g_hash_table_lookup (table, key), -1);
+            g_hash_table_remove (table, key);
+        }
+        else
+        {
+            PulseChange *change = g_new0 (PulseChange, 1);
+            change->facility = facility;
+            change->index = GPOINTER_TO_UINT (key);
+            fetch = g_list_prepend (fetch, change);
+        }
+    }
+    g_hash_table_remove_all (changes);
+    return fetch;
+}
+
+/* Callback for local model update - the affected parts of the display are refreshed from the new model */
+
+static void pa_cb_model_updated (VolumePulsePlugin *vol, gboolean, gpointer data)
+{
+    guint dirty = GPOINTER_TO_UINT (data);
+
+    // a full update of a direction includes its visibility
+    if (dirty & PA_DIRTY_OUTPUT) update_display (vol, FALSE);
+    else if (dirty & PA_DIRTY_VISIBLE) update_visibility (vol, FALSE);
+    if (dirty & PA_DIRTY_INPUT) update_display (vol, TRUE);
+    else if (dirty & PA_DIRTY_VISIBLE) update_visibility (vol, TRUE);
+
+    // devices added or removed mean the menus are rebuilt; a change of default is patched in
+    if (dirty & PA_DIRTY_MENU_OUT) menu_invalidate (vol, FALSE);
+    else if (dirty & PA_DIRTY_SERVER) menu_update (vol, FALSE);
+    if (dirty & PA_DIRTY_MENU_IN) menu_invalidate (vol, TRUE);
+    else if (dirty & PA_DIRTY_SERVER) menu_update (vol, TRUE);
+    if (dirty & PA_DIRTY_PROFILES) profiles_dialog_update (vol);
+
+    // a Bluetooth connection may be waiting for its card, sink or source
+    bluetooth_pulse_changed (vol);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Controller callbacks                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* 
+ * These are called on the controller thread with the mainloop lock held.
+ * They copy any data returned into the results list of the operation
+ * and post the operation to the GTK thread when it has finished; they
+ * must not touch any GTK widgets or any of the plugin data.
+ */
+
 /* Callback for PulseAudio operations which report success/fail */
 
 static void pa_cb_generic_success (pa_context *context, int success, void *userdata)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    PulseOp *paop = (PulseOp *) userdata;
 
     if (!success)
     {
         DEBUG ("pulse success callback failed : %s", pa_strerror (pa_context_errno (context)));
-        vol->pa_error_msg = g_strdup (pa_strerror (pa_context_errno (context)));
+        paop->error_msg = g_strdup (pa_strerror (pa_context_errno (context)));
     }
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    pa_op_complete (paop);
+}
+
+/* Callbacks for card, sink and source queries */
+
+static void pa_cb_get_cards (pa_context *context, const pa_card_info *i, int eol, void *userdata)
+{
+    PulseOp *paop = (PulseOp *) userdata;
+
+    if (!eol)
+    {
+        paop->results = g_list_append (paop->results, pa_card_new (i));
+        return;
+    }
+
+    if (eol < 0) paop->error_msg = g_strdup (pa_strerror (pa_context_errno (context)));
+    pa_op_complete (paop);
+}
+
+static void pa_cb_get_sinks (pa_context *context, const pa_sink_info *i, int eol, void *userdata)
+{
+    PulseOp *paop = (PulseOp *) userdata;
+
+    if (!eol)
+    {
+        paop->results = g_list_append (paop->results, pa_sink_new (i));
+        return;
+    }
+
+    if (eol < 0) paop->error_msg = g_strdup (pa_strerror (pa_context_errno (context)));
+    pa_op_complete (paop);
+}
+
+static void pa_cb_get_sources (pa_context *context, const pa_source_info *i, int eol, void *userdata)
+{
+    PulseOp *paop = (PulseOp *) userdata;
+
+    if (!eol)
+    {
+        paop->results = g_list_append (paop->results, pa_source_new (i));
+        return;
+    }
+
+    if (eol < 0) paop->error_msg = g_strdup (pa_strerror (pa_context_errno (context)));
+    pa_op_complete (paop);
+}
+
+/* Callback for each operation in a batch - the batch completes when all have replied */
+
+static void pa_cb_batch_success (pa_context *context, int success, void *userdata)
+{
+    PulseOp *paop = (PulseOp *) userdata;
+    uint32_t index = GPOINTER_TO_UINT (paop->results->data);
+
+    if (!success)
+    {
+        char *msg = g_strdup_printf ("%s%sstream %d : %s", paop->error_msg ? paop->error_msg : "",
+            paop->error_msg ? "; " : "", index, pa_strerror (pa_context_errno (context)));
+        DEBUG ("pulse batch operation failed : stream %d", index);
+        g_free (paop->error_msg);
+        paop->error_msg = msg;
+    }
+
+    paop->results = g_list_delete_link (paop->results, paop->results);
+    if (!paop->results) pa_op_complete (paop);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Local model                                                                */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The plugin keeps a local copy of the cards, sinks and sources known to the
+ * server, held in hash tables keyed by index, along with the names of the
+ * default sink and source. The model is read when the controller connects,
+ * and re-read when the server notifies a change; everything the plugin shows
+ * is read from the model, so no server access is needed to update the display
+ * or to build the menus and profiles dialog.
+ */
+
+/*
+ * Re-read the parts of the model shown by the dirty flags, and the single objects
+ * in the list of changes - the supplied callback is called when all of them have
+ * been updated. The server replies in order, so the callback is attached to the
+ * last query submitted.
+ */
+
+static int pa_update_model (VolumePulsePlugin *vol, guint dirty, GList *changes, PulseCallback cb, gpointer data)
+{
+    guint queries = g_list_length (changes);
+    GList *l;
+
+    DEBUG ("pa_update_model %02x", dirty);
+    if (dirty & PA_DIRTY_CARDS) queries++;
+    if (dirty & PA_DIRTY_SINKS) queries++;
+    if (dirty & PA_DIRTY_SOURCES) queries++;
+    if (dirty & PA_DIRTY_SERVER) queries++;
+
+    // nothing to read, so the callback can be called now
+    if (!queries)
+    {
+        if (cb) cb (vol, TRUE, data);
+        return 1;
+    }
+
+    if ((dirty & PA_DIRTY_CARDS) && !pa_get_cards (vol, --queries ? NULL : cb, data)) return 0;
+    if ((dirty & PA_DIRTY_SINKS) && !pa_get_sinks (vol, --queries ? NULL : cb, data)) return 0;
+    if ((dirty & PA_DIRTY_SOURCES) && !pa_get_sources (vol, --queries ? NULL : cb, data)) return 0;
+    for (l = changes; l != NULL; l = l->next)
+        if (!pa_get_by_index (vol, (PulseChange *) l->data, --queries ? NULL : cb, data)) return 0;
+    if ((dirty & PA_DIRTY_SERVER) && !pa_get_default_sink_source (vol, cb, data)) return 0;
+    return 1;
+}
+
+/* Query the controller for the lists of cards, sinks and sources */
+
+static int pa_get_cards (VolumePulsePlugin *vol, PulseCallback cb, gpointer data)
+{
+    START_PA_OPERATION (pa_done_get_cards, cb, data)
+    paop->free_result = pa_card_free;
+    op = pa_context_get_card_info_list (vol->pa_cont, &pa_cb_get_cards, paop);
+    END_PA_OPERATION ("get_card_info_list")
+}
+
+static int pa_get_sinks (VolumePulsePlugin *vol, PulseCallback cb, gpointer data)
+{
+    START_PA_OPERATION (pa_done_get_sinks, cb, data)
+    paop->free_result = pa_device_free;
+    op = pa_context_get_sink_info_list (vol->pa_cont, &pa_cb_get_sinks, paop);
+    END_PA_OPERATION ("get_sink_info_list")
+}
+
+static int pa_get_sources (VolumePulsePlugin *vol, PulseCallback cb, gpointer data)
+{
+    START_PA_OPERATION (pa_done_get_sources, cb, data)
+    paop->free_result = pa_device_free;
+    op = pa_context_get_source_info_list (vol->pa_cont, &pa_cb_get_sources, paop);
+    END_PA_OPERATION ("get_source_info_list")
+}
+
+/* Completions for card, sink and source queries */
+
+static void pa_done_get_cards (PulseOp *paop)
+{
+    VolumePulsePlugin *vol = paop->vol;
+    GHashTableIter iter;
+    gpointer value;
+
+    pa_index_bluez_table (vol, PA_SUBSCRIPTION_EVENT_CARD, -1);
+    pa_replace_records (vol->pa_cards, paop);
+    pa_index_bluez_table (vol, PA_SUBSCRIPTION_EVENT_CARD, 1);
+
+    vol->pa_count[0] = 0;
+    vol->pa_count[1] = 0;
+    if (!vol->pa_cards) return;
+    g_hash_table_iter_init (&iter, vol->pa_cards);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) pa_count_card (vol, (PulseCard *) value, 1);
+}
+
+static void pa_done_get_sinks (PulseOp *paop)
+{
+    pa_index_bluez_table (paop->vol, PA_SUBSCRIPTION_EVENT_SINK, -1);
+    pa_replace_records (paop->vol->pa_sinks, paop);
+    pa_index_bluez_table (paop->vol, PA_SUBSCRIPTION_EVENT_SINK, 1);
+}
+
+static void pa_done_get_sources (PulseOp *paop)
+{
+    pa_index_bluez_table (paop->vol, PA_SUBSCRIPTION_EVENT_SOURCE, -1);
+    pa_replace_records (paop->vol->pa_sources, paop);
+    pa_index_bluez_table (paop->vol, PA_SUBSCRIPTION_EVENT_SOURCE, 1);
+}
+
+/* Replace the contents of a table in the model with the records returned by a query */
+
+static void pa_replace_records (GHashTable *table, PulseOp *paop)
+{
+    GList *l;
+
+    if (paop->error_msg || !table) return;
+
+    g_hash_table_remove_all (table);
+    for (l = paop->results; l != NULL; l = l->next)
+    {
+        // the index is the first field of both cards and devices
+        g_hash_table_insert (table, GUINT_TO_POINTER (*((uint32_t *) l->data)), l->data);
+    }
+
+    // the records now belong to the table
+    g_list_free (paop->results);
+    paop->results = NULL;
+}
+
+/* Query the controller for a single card, sink or source */
+
+static int pa_get_by_index (VolumePulsePlugin *vol, PulseChange *change, PulseCallback cb, gpointer data)
+{
+    START_PA_OPERATION (NULL, cb, data)
+    paop->index = change->index;
+    switch (change->facility)
+    {
+        case PA_SUBSCRIPTION_EVENT_CARD :
+            paop->done = pa_done_get_card_by_index;
+            paop->free_result = pa_card_free;
+            op = pa_context_get_card_info_by_index (vol->pa_cont, change->index, &pa_cb_get_cards, paop);
+            break;
+
+        case PA_SUBSCRIPTION_EVENT_SINK :
+            paop->done = pa_done_get_sink_by_index;
+            paop->free_result = pa_device_free;
+            op = pa_context_get_sink_info_by_index (vol->pa_cont, change->index, &pa_cb_get_sinks, paop);
+            break;
+
+        default :
+            paop->done = pa_done_get_source_by_index;
+            paop->free_result = pa_device_free;
+            op = pa_context_get_source_info_by_index (vol->pa_cont, change->index, &pa_cb_get_sources, paop);
+            break;
+    }
+    END_PA_OPERATION ("get_info_by_index")
+}
+
+/* Completions for single card, sink and source queries */
+
+static void pa_done_get_card_by_index (PulseOp *paop)
+{
+    VolumePulsePlugin *vol = paop->vol;
+
+    if (!vol->pa_cards) return;
+    pa_count_card (vol, g_hash_table_lookup (vol->pa_cards, GUINT_TO_POINTER (paop->index)), -1);
+    pa_index_bluez (vol, PA_SUBSCRIPTION_EVENT_CARD, g_hash_table_lookup (vol->pa_cards, GUINT_TO_POINTER (paop->index)), -1);
+    pa_replace_record (vol->pa_cards, paop);
+    pa_count_card (vol, g_hash_table_lookup (vol->pa_cards, GUINT_TO_POINTER (paop->index)), 1);
+    pa_index_bluez (vol, PA_SUBSCRIPTION_EVENT_CARD, g_hash_table_lookup (vol->pa_cards, GUINT_TO_POINTER (paop->index)), 1);
+}
+
+static void pa_done_get_sink_by_index (PulseOp *paop)
+{
+    VolumePulsePlugin *vol = paop->vol;
+
+    if (!vol->pa_sinks) return;
+    pa_index_bluez (vol, PA_SUBSCRIPTION_EVENT_SINK, g_hash_table_lookup (vol->pa_sinks, GUINT_TO_POINTER (paop->index)), -1);
+    pa_replace_record (vol->pa_sinks, paop);
+    pa_index_bluez (vol, PA_SUBSCRIPTION_EVENT_SINK, g_hash_table_lookup (vol->pa_sinks, GUINT_TO_POINTER (paop->index)), 1);
+    pa_keep_written_volume (vol, g_hash_table_lookup (vol->pa_sinks, GUINT_TO_POINTER (paop->index)));
+}
+
+static void pa_done_get_source_by_index (PulseOp *paop)
+{
+    VolumePulsePlugin *vol = paop->vol;
+
+    if (!vol->pa_sources) return;
+    pa_index_bluez (vol, PA_SUBSCRIPTION_EVENT_SOURCE, g_hash_table_lookup (vol->pa_sources, GUINT_TO_POINTER (paop->index)), -1);
+    pa_replace_record (vol->pa_sources, paop);
+    pa_index_bluez (vol, PA_SUBSCRIPTION_EVENT_SOURCE, g_hash_table_lookup (vol->pa_sources, GUINT_TO_POINTER (paop->index)), 1);
+    pa_keep_written_volume (vol, g_hash_table_lookup (vol->pa_sources, GUINT_TO_POINTER (paop->index)));
+}
+
+/*
+ * Replace a single record in the model - if the query returned nothing, the object
+ * has gone from the server since it was notified, so it is removed from the model
+ */
+
+static void pa_replace_record (GHashTable *table, PulseOp *paop)
+{
+    if (!table) return;
+
+    if (!paop->results)
+    {
+        g_hash_table_remove (table, GUINT_TO_POINTER (paop->index));
+        return;
+    }
+
+    g_hash_table_insert (table, GUINT_TO_POINTER (paop->index), paop->results->data);
+
+    // the record now belongs to the table
+    g_list_free (paop->results);
+    paop->results = NULL;
+}
+
+/*
+ * The numbers of cards with outputs and inputs are kept as counters, adjusted
+ * as cards are added to and removed from the model, so that deciding whether
+ * to show the icons needs no searching.
+ */
+
+static void pa_count_card (VolumePulsePlugin *vol, PulseCard *card, int delta)
+{
+    if (!card || !card->alsa_name) return;
+    if (card->has_output) vol->pa_count[0] += delta;
+    if (card->has_input) vol->pa_count[1] += delta;
+}
+
+/*
+ * Bluetooth cards, sinks and sources are indexed by the BlueZ object path of
+ * their device ("bluez.path"), so that the Bluetooth code can find them from
+ * the device without rebuilding their names. Sinks and sources are only taken
+ * to be Bluetooth audio endpoints if they have a "bluetooth.protocol". As with
+ * the card counters, the index is adjusted as records enter and leave the model.
+ */
+
+static void pa_index_bluez (VolumePulsePlugin *vol, guint facility, gpointer record, int delta)
+{
+    PulseBluez *entry;
+    const char *path;
+    uint32_t index, *slot;
+
+    if (!record || !vol->pa_bluez) return;
+    if (facility == PA_SUBSCRIPTION_EVENT_CARD)
+    {
+        path = ((PulseCard *) record)->bluez_path;
+        index = ((PulseCard *) record)->index;
+    }
+    else
+    {
+        if (!((PulseDevice *) record)->bt_protocol) return;
+        path = ((PulseDevice *) record)->bluez_path;
+        index = ((PulseDevice *) record)->index;
+    }
+    if (!path) return;
+
+    entry = g_hash_table_lookup (vol->pa_bluez, path);
+    if (delta > 0)
+    {
+        if (!entry)
+        {
+            entry = g_new (PulseBluez, 1);
+            entry->card = PA_INVALID_INDEX;
+            entry->device[0] = PA_INVALID_INDEX;
+            entry->device[1] = PA_INVALID_INDEX;
+            g_hash_table_insert (vol->pa_bluez, g_strdup (path), entry);
+        }
+        *pa_bluez_slot (entry, facility) = index;
+    }
+    else if (entry)
+    {
+        // a newer object for the device may already have taken the slot
+        slot = pa_bluez_slot (entry, facility);
+        if (*slot == index) *slot = PA_INVALID_INDEX;
+        if (entry->card == PA_INVALID_INDEX && entry->device[0] == PA_INVALID_INDEX && entry->device[1] == PA_INVALID_INDEX)
+            g_hash_table_remove (vol->pa_bluez, path);
+    }
+}
+
+static void pa_index_bluez_table (VolumePulsePlugin *vol, guint facility, int delta)
+{
+    GHashTable *table = facility == PA_SUBSCRIPTION_EVENT_CARD ? vol->pa_cards
+        : (facility == PA_SUBSCRIPTION_EVENT_SINK ? vol->pa_sinks : vol->pa_sources);
+    GHashTableIter iter;
+    gpointer value;
+
+    if (!table) return;
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) pa_index_bluez (vol, facility, value, delta);
+}
+
+static uint32_t *pa_bluez_slot (PulseBluez *entry, guint facility)
+{
+    if (facility == PA_SUBSCRIPTION_EVENT_CARD) return &entry->card;
+    return &entry->device[facility == PA_SUBSCRIPTION_EVENT_SOURCE ? 1 : 0];
+}
+
+/* Find the index entry for a BlueZ device */
+
+static PulseBluez *pa_find_bluez (VolumePulsePlugin *vol, const char *path)
+{
+    if (!vol->pa_bluez || !path) return NULL;
+    return (PulseBluez *) g_hash_table_lookup (vol->pa_bluez, path);
+}
+
+/* Query the controller for the names of the default sink and source */
+
+static int pa_get_default_sink_source (VolumePulsePlugin *vol, PulseCallback cb, gpointer data)
+{
+    DEBUG ("pa_get_default_sink_source");
+    START_PA_OPERATION (pa_done_get_default_sink_source, cb, data)
+    paop->free_result = g_free;
+    op = pa_context_get_server_info (vol->pa_cont, &pa_cb_get_default_sink_source, paop);
+    END_PA_OPERATION ("get_server_info")
+}
+
+/* Callback for default sink and source query */
+
+static void pa_cb_get_default_sink_source (pa_context *, const pa_server_info *i, void *userdata)
+{
+    PulseOp *paop = (PulseOp *) userdata;
+
+    DEBUG ("pa_cb_get_default_sink_source %s %s", i->default_sink_name, i->default_source_name);
+    paop->results = g_list_append (paop->results, g_strdup (i->default_sink_name));
+    paop->results = g_list_append (paop->results, g_strdup (i->default_source_name));
+
+    pa_op_complete (paop);
+}
+
+static void pa_done_get_default_sink_source (PulseOp *paop)
+{
+    VolumePulsePlugin *vol = paop->vol;
+
+    if (g_list_length (paop->results) != 2) return;
+
+    if (vol->pa_default_sink) g_free (vol->pa_default_sink);
+    vol->pa_default_sink = g_strdup ((char *) g_list_nth_data (paop->results, 0));
+
+    if (vol->pa_default_source) g_free (vol->pa_default_source);
+    vol->pa_default_source = g_strdup ((char *) g_list_nth_data (paop->results, 1));
+}
+
+/* Find a sink or source in the model by name */
+
+static PulseDevice *pa_find_device (GHashTable *table, const char *name)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if (!table || !name) return NULL;
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        if (!g_strcmp0 (((PulseDevice *) value)->name, name)) return (PulseDevice *) value;
+    return NULL;
+}
+
+/* Find a card in the model by name */
+
+static PulseCard *pa_find_card (VolumePulsePlugin *vol, const char *name)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if (!vol->pa_cards || !name) return NULL;
+    g_hash_table_iter_init (&iter, vol->pa_cards);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        if (!g_strcmp0 (((PulseCard *) value)->name, name)) return (PulseCard *) value;
+    return NULL;
+}
+
+/* Find the current default sink or source in the model */
+
+static PulseDevice *pa_default_device (VolumePulsePlugin *vol, gboolean input_control)
+{
+    if (input_control) return pa_find_device (vol->pa_sources, vol->pa_default_source);
+    else return pa_find_device (vol->pa_sinks, vol->pa_default_sink);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -343,200 +1344,215 @@ static void pa_cb_generic_success (pa_context *context, int success, void *userd
 /*----------------------------------------------------------------------------*/
 
 /* 
- * For get operations, the generic get_sink_info operation is called on the
- * current default sink; the values are written into the global structure
- * by the callbacks, and the top-level functions return them from there.
- * For set operations, the specific set_sink_xxx operations are called.
+ * For get operations, the volume and mute settings for the current default
+ * sink or source are read from the local model. For set operations, the
+ * model is updated immediately and the specific set_sink_xxx operations
+ * are called; the server then notifies the change, which confirms the model.
  */
 
 int pulse_get_volume (VolumePulsePlugin *vol, gboolean input_control)
 {
-    pa_get_current_vol_mute (vol, input_control);
-    return vol->pa_volume / PA_VOL_SCALE;
+    PulseDevice *dev = pa_default_device (vol, input_control);
+    return dev ? dev->volume / PA_VOL_SCALE : 0;
 }
 
 int pulse_set_volume (VolumePulsePlugin *vol, int volume, gboolean input_control)
 {
-    pa_cvolume cvol;
-    int i;
+    PulseDevice *dev = pa_default_device (vol, input_control);
 
-    vol->pa_volume = volume * PA_VOL_SCALE;
-    if (vol->pa_volume < 0) vol->pa_volume = 0;
-    if (vol->pa_volume > 65535) vol->pa_volume = 65535;
-    cvol.channels = vol->pa_channels;
-    for (i = 0; i < cvol.channels; i++) cvol.values[i] = vol->pa_volume;
+    if (!dev) return 0;
+    dev->volume = volume * PA_VOL_SCALE;
+    if (dev->volume < 0) dev->volume = 0;
+    if (dev->volume > 65535) dev->volume = 65535;
 
     DEBUG ("pulse_set_volume %d %d", volume, input_control);
-    START_PA_OPERATION
-    if (input_control)
-        op = pa_context_set_source_volume_by_name (vol->pa_cont, vol->pa_default_source, &cvol, &pa_cb_generic_success, vol);
-    else
-        op = pa_context_set_sink_volume_by_name (vol->pa_cont, vol->pa_default_sink, &cvol, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("set_sink_volume_by_name")
+    return pa_write_volume (vol, dev, input_control);
 }
 
-int pulse_get_mute (VolumePulsePlugin *vol, gboolean input_control)
-{
-    pa_get_current_vol_mute (vol, input_control);
-    return vol->pa_mute;
-}
+/*
+ * Volume writes are coalesced so that there is at most one in flight to each
+ * device. The model is updated as soon as a new volume is requested, so the
+ * display follows the slider immediately; if a write to the device is already
+ * in flight, the new volume just replaces any which is waiting, and the latest
+ * is sent when the server replies. Dragging a slider therefore sends only as
+ * many writes as the server can keep up with, and the last one is always sent.
+ */
 
-int pulse_set_mute (VolumePulsePlugin *vol, int mute, gboolean input_control)
+static int pa_write_volume (VolumePulsePlugin *vol, PulseDevice *dev, gboolean input_control)
 {
-    vol->pa_mute = mute;
+    PulseVolumeWrite *write;
 
-    DEBUG ("pulse_set_mute %d %d", mute, input_control);
-    START_PA_OPERATION
-    if (input_control)
-        op = pa_context_set_source_mute_by_name (vol->pa_cont, vol->pa_default_source, vol->pa_mute, &pa_cb_generic_success, vol);
-    else
-        op = pa_context_set_sink_mute_by_name (vol->pa_cont, vol->pa_default_sink, vol->pa_mute, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("set_sink_mute_by_name");
+    if (!vol->pa_volume_writes) return 0;
+    write = g_hash_table_lookup (vol->pa_volume_writes, dev->name);
+    if (!write)
+    {
+        write = g_new0 (PulseVolumeWrite, 1);
+        write->name = g_strdup (dev->name);
+        write->input = input_control;
+        g_hash_table_insert (vol->pa_volume_writes, write->name, write);
+    }
+    write->volume = dev->volume;
+
+    if (write->in_flight)
+    {
+        write->pending = TRUE;
+        return 1;
+    }
+    return pa_submit_volume (vol, write);
 }
 
-/* Query the controller for the volume and mute settings for the current default sink */
+/* Send the most recent volume requested for a device to the server */
 
-static int pa_get_current_vol_mute (VolumePulsePlugin *vol, gboolean input_control)
+static int pa_submit_volume (VolumePulsePlugin *vol, PulseVolumeWrite *write)
 {
-    START_PA_OPERATION
-    if (input_control)
-        op = pa_context_get_source_info_by_name (vol->pa_cont, vol->pa_default_source, &pa_cb_get_current_input_vol_mute, vol);
-    else
-        op = pa_context_get_sink_info_by_name (vol->pa_cont, vol->pa_default_sink, &pa_cb_get_current_vol_mute, vol);
-    END_PA_OPERATION ("get_sink_info_by_name")
-}
+    PulseDevice *dev = pa_find_device (write->input ? vol->pa_sources : vol->pa_sinks, write->name);
+    pa_cvolume cvol;
+    int i;
 
-/* Callback for volume / mute query */
+    // the number of channels is only known if the device is in the model
+    write->pending = FALSE;
+    if (!dev) return 0;
+    cvol.channels = dev->channels;
+    for (i = 0; i < cvol.channels; i++) cvol.values[i] = write->volume;
 
-static void pa_cb_get_current_vol_mute (pa_context *, const pa_sink_info *i, int eol, void *userdata)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    DEBUG ("pa_submit_volume %s %d", write->name, write->volume);
 
-    if (!eol)
+    // if the operation is not submitted its callback never runs, so the write is taken out of flight -
+    // unless the failure terminated the controller, which frees the write along with the table
+    write->in_flight = TRUE;
+    if (!pa_send_volume (vol, write, &cvol))
     {
-        vol->pa_channels = i->volume.channels;
-        vol->pa_volume = i->volume.values[0];
-        vol->pa_mute = i->mute;
+        if (vol->pa_volume_writes) write->in_flight = FALSE;
+        return 0;
     }
-
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    return 1;
 }
 
-static void pa_cb_get_current_input_vol_mute (pa_context *, const pa_source_info *i, int eol, void *userdata)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    if (!eol)
-    {
-        vol->pa_channels = i->volume.channels;
-        vol->pa_volume = i->volume.values[0];
-        vol->pa_mute = i->mute;
-    }
+/* Call the PulseAudio set volume operation for a write */
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+static int pa_send_volume (VolumePulsePlugin *vol, PulseVolumeWrite *write, const pa_cvolume *cvol)
+{
+    START_PA_OPERATION (NULL, pa_cb_volume_written, write)
+    if (write->input)
+        op = pa_context_set_source_volume_by_name (vol->pa_cont, write->name, cvol, &pa_cb_generic_success, paop);
+    else
+        op = pa_context_set_sink_volume_by_name (vol->pa_cont, write->name, cvol, &pa_cb_generic_success, paop);
+    END_PA_OPERATION ("set_volume_by_name")
 }
 
-/* Set volume for new sink to global value read from old sink */
+/* Callback for a volume write - sends the volume which has been waiting, if any */
 
-static int pa_restore_volume (VolumePulsePlugin *vol)
+static void pa_cb_volume_written (VolumePulsePlugin *vol, gboolean, gpointer data)
 {
-    pa_cvolume cvol;
-    int i;
+    PulseVolumeWrite *write = (PulseVolumeWrite *) data;
 
-    cvol.channels = vol->pa_channels;
-    for (i = 0; i < cvol.channels; i++) cvol.values[i] = vol->pa_volume;
-
-    DEBUG ("pa_restore_volume");
-    START_PA_OPERATION
-    op = pa_context_set_sink_volume_by_name (vol->pa_cont, vol->pa_default_sink, &cvol, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("set_sink_volume_by_name")
+    write->in_flight = FALSE;
+    if (write->pending) pa_submit_volume (vol, write);
 }
 
-/* Set mute for new sink to global value read from old sink */
+/*
+ * Notifications of the server's volume can arrive while later writes are still
+ * in progress; the volume most recently requested is kept in the model until
+ * the server has been sent it, so the slider does not jump back.
+ */
 
-static int pa_restore_mute (VolumePulsePlugin *vol)
+static void pa_keep_written_volume (VolumePulsePlugin *vol, PulseDevice *dev)
 {
-    DEBUG ("pa_restore_mute");
-    START_PA_OPERATION
-    op = pa_context_set_sink_mute_by_name (vol->pa_cont, vol->pa_default_sink, vol->pa_mute, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("set_sink_mute_by_name");
-}
+    PulseVolumeWrite *write;
 
-/* Query the controller for the number of channels on the current default sink */
+    if (!dev || !vol->pa_volume_writes) return;
+    write = g_hash_table_lookup (vol->pa_volume_writes, dev->name);
+    if (write && (write->in_flight || write->pending)) dev->volume = write->volume;
+}
 
-static int pa_get_channels (VolumePulsePlugin *vol)
+static void pa_volume_write_free (gpointer data)
 {
-    START_PA_OPERATION
-    op = pa_context_get_sink_info_by_name (vol->pa_cont, vol->pa_default_sink, &pa_cb_get_channels, vol);
-    END_PA_OPERATION ("get_sink_info_by_name")
+    PulseVolumeWrite *write = (PulseVolumeWrite *) data;
+
+    g_free (write->name);
+    g_free (write);
 }
 
-/* Callback for volume / mute query */
+int pulse_get_mute (VolumePulsePlugin *vol, gboolean input_control)
+{
+    PulseDevice *dev = pa_default_device (vol, input_control);
+    return dev ? dev->mute : 0;
+}
 
-static void pa_cb_get_channels (pa_context *, const pa_sink_info *i, int eol, void *userdata)
+int pulse_set_mute (VolumePulsePlugin *vol, int mute, gboolean input_control)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    PulseDevice *dev = pa_default_device (vol, input_control);
 
-    if (!eol)
-    {
-        vol->pa_channels = i->volume.channels;
-    }
+    if (dev) dev->mute = mute;
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    DEBUG ("pulse_set_mute %d %d", mute, input_control);
+    START_PA_OPERATION (NULL, NULL, NULL)
+    if (input_control)
+        op = pa_context_set_source_mute_by_name (vol->pa_cont, vol->pa_default_source, mute, &pa_cb_generic_success, paop);
+    else
+        op = pa_context_set_sink_mute_by_name (vol->pa_cont, vol->pa_default_sink, mute, &pa_cb_generic_success, paop);
+    END_PA_OPERATION ("set_sink_mute_by_name");
 }
 
-/*----------------------------------------------------------------------------*/
-/* Sink and source control                                                    */
-/*----------------------------------------------------------------------------*/
-
-/* Update the names of the current default sink and source in the plugin data structure */
+/* Set volume for new sink to value read from old sink */
 
-int pulse_get_default_sink_source (VolumePulsePlugin *vol)
+static int pa_restore_volume (VolumePulsePlugin *vol, int volume)
 {
-    DEBUG ("pulse_get_default_sink_source");
-    START_PA_OPERATION
-    op = pa_context_get_server_info (vol->pa_cont, &pa_cb_get_default_sink_source, vol);
-    END_PA_OPERATION ("get_server_info")
+    PulseDevice *dev = pa_default_device (vol, FALSE);
+
+    // the number of channels is only known if the new sink is in the model
+    if (!dev) return 0;
+    dev->volume = volume;
+
+    DEBUG ("pa_restore_volume");
+    return pa_write_volume (vol, dev, FALSE);
 }
 
-/* Callback for default sink and source query */
+/* Set mute for new sink to value read from old sink */
 
-static void pa_cb_get_default_sink_source (pa_context *, const pa_server_info *i, void *userdata)
+static int pa_restore_mute (VolumePulsePlugin *vol, int mute)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    DEBUG ("pa_cb_get_default_sink_source %s %s", i->default_sink_name, i->default_source_name);
-    if (vol->pa_default_sink) g_free (vol->pa_default_sink);
-    vol->pa_default_sink = g_strdup (i->default_sink_name);
+    PulseDevice *dev = pa_default_device (vol, FALSE);
 
-    if (vol->pa_default_source) g_free (vol->pa_default_source);
-    vol->pa_default_source = g_strdup (i->default_source_name);
+    if (dev) dev->mute = mute;
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    DEBUG ("pa_restore_mute");
+    START_PA_OPERATION (NULL, NULL, NULL)
+    op = pa_context_set_sink_mute_by_name (vol->pa_cont, vol->pa_default_sink, mute, &pa_cb_generic_success, paop);
+    END_PA_OPERATION ("set_sink_mute_by_name");
 }
 
+/*----------------------------------------------------------------------------*/
+/* Sink and source control                                                    */
+/*----------------------------------------------------------------------------*/
+
 /*
  * To change sink, first the default sink is updated to the new sink.
- * Then, all currently active output streams are listed in pa_indices.
- * Finally, all streams listed in pa_indices are moved to the new sink.
+ * Then the volume and mute of the old sink are copied to it; these are
+ * queued behind the change of default, which the server handles first.
+ * Moving the current output streams is done separately by pulse_move_output_streams.
  */
 
-int pulse_change_sink (VolumePulsePlugin *vol, const char *sinkname)
+int pulse_change_sink (VolumePulsePlugin *vol, const char *sinkname, PulseCallback cb, gpointer data)
 {
+    PulseDevice *dev = pa_default_device (vol, FALSE);
+    int volume = dev ? dev->volume : 0, mute = dev ? dev->mute : 0;
+    gboolean restore = dev != NULL;
+
     DEBUG ("pulse_change_sink %s", sinkname);
     if (vol->pa_default_sink) g_free (vol->pa_default_sink);
     vol->pa_default_sink = g_strdup (sinkname);
 
-    if (!pa_set_default_sink (vol, sinkname))
+    if (!pa_set_default_sink (vol, sinkname, cb, data))
     {
         DEBUG ("pulse_change_sink error");
         return 0;
     }
-    else
+
+    if (restore)
     {
-        pa_get_channels (vol);
-        pa_restore_volume (vol);
-        pa_restore_mute (vol);
+        pa_restore_volume (vol, volume);
+        pa_restore_mute (vol, mute);
     }
     DEBUG ("pulse_change_sink done");
     return 1;
@@ -547,96 +1563,93 @@ int pulse_change_sink (VolumePulsePlugin *vol, const char *sinkname)
 void pulse_move_output_streams (VolumePulsePlugin *vol)
 {
     DEBUG ("pulse_move_output_streams");
-    vol->pa_indices = NULL;
-    pa_get_output_streams (vol);
-    g_list_foreach (vol->pa_indices, pa_list_move_to_default_sink, vol);
-    g_list_free (vol->pa_indices);
-    DEBUG ("pulse_move_output_streams done");
+    pa_get_output_streams (vol, pa_done_move_output_streams);
 }
 
 /* Call the PulseAudio set default sink operation */
 
-static int pa_set_default_sink (VolumePulsePlugin *vol, const char *sinkname)
+static int pa_set_default_sink (VolumePulsePlugin *vol, const char *sinkname, PulseCallback cb, gpointer data)
 {
     DEBUG ("pa_set_default_sink %s", sinkname);
-    START_PA_OPERATION
-    op = pa_context_set_default_sink (vol->pa_cont, sinkname, &pa_cb_generic_success, vol);
+    START_PA_OPERATION (NULL, cb, data)
+    op = pa_context_set_default_sink (vol->pa_cont, sinkname, &pa_cb_generic_success, paop);
     END_PA_OPERATION ("set_default_sink")
 }
 
 /* Query the controller for a list of current output streams */
 
-static int pa_get_output_streams (VolumePulsePlugin *vol)
+static int pa_get_output_streams (VolumePulsePlugin *vol, PulseOpDone done)
 {
     DEBUG ("pa_get_output_streams");
-    START_PA_OPERATION
-    op = pa_context_get_sink_input_info_list (vol->pa_cont, &pa_cb_get_output_streams, vol);
+    START_PA_OPERATION (done, NULL, NULL)
+    paop->free_result = g_free;
+    op = pa_context_get_sink_input_info_list (vol->pa_cont, &pa_cb_get_output_streams, paop);
     END_PA_OPERATION ("get_sink_input_info_list")
 }
 
 /* Callback for output stream query */
 
-static void pa_cb_get_output_streams (pa_context *, const pa_sink_input_info *i, int eol, void *userdata)
+static void pa_cb_get_output_streams (pa_context *context, const pa_sink_input_info *i, int eol, void *userdata)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    PulseOp *paop = (PulseOp *) userdata;
 
     if (!eol)
     {
+        PulseStream *stream = g_new0 (PulseStream, 1);
         DEBUG ("pa_cb_get_output_streams %d", i->index);
-        vol->pa_indices = g_list_append (vol->pa_indices, (void *) ((uintptr_t) i->index));
+        stream->index = i->index;
+        stream->device = i->sink;
+        stream->mute = i->mute;
+        paop->results = g_list_append (paop->results, stream);
+        return;
     }
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    if (eol < 0) paop->error_msg = g_strdup (pa_strerror (pa_context_errno (context)));
+    pa_op_complete (paop);
 }
 
-/* Callback for per-stream operation by looping through pa_indices, moving stream for each */
+/* Completion for output stream query - moves each listed stream not already on the default sink in a single batch */
 
-static void pa_list_move_to_default_sink (gpointer data, gpointer userdata)
+static void pa_done_move_output_streams (PulseOp *paop)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    VolumePulsePlugin *vol = paop->vol;
+    PulseDevice *dev = pa_find_device (vol->pa_sinks, vol->pa_default_sink);
 
-    pa_move_stream_to_default_sink (vol, (uintptr_t) data);
+    if (!vol->pa_default_sink) return;
+    pa_run_batch (vol, pa_select_streams (paop->results, pa_stream_not_on_device, dev ? dev->index : PA_INVALID_INDEX),
+        pa_move_stream_to_default_sink, "move_sink_input_by_name");
+    DEBUG ("pulse_move_output_streams done");
 }
 
-/* Call the PulseAudio move stream operation for the supplied index to move the stream to the default sink */
+/* Submit the PulseAudio move stream operation for the supplied index to move the stream to the default sink - called in a batch */
 
-static int pa_move_stream_to_default_sink (VolumePulsePlugin *vol, int index)
+static pa_operation *pa_move_stream_to_default_sink (VolumePulsePlugin *vol, uint32_t index, PulseOp *paop)
 {
     DEBUG ("pa_move_stream_to_default_sink %s %d", vol->pa_default_sink, index);
-    START_PA_OPERATION
-    op = pa_context_move_sink_input_by_name (vol->pa_cont, index, vol->pa_default_sink, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("move_sink_input_by_name")
+    return pa_context_move_sink_input_by_name (vol->pa_cont, index, vol->pa_default_sink, &pa_cb_batch_success, paop);
 }
 
 /*
- * To change source, first the default source is updated to the new source.
- * Then, all currently active input streams are listed in pa_indices.
- * Finally, all streams listed in pa_indices are moved to the new source.
+ * To change source, the default source is updated to the new source.
+ * Moving the current input streams is done separately by pulse_move_input_streams.
  */
  
-int pulse_change_source (VolumePulsePlugin *vol, const char *sourcename)
+int pulse_change_source (VolumePulsePlugin *vol, const char *sourcename, PulseCallback cb, gpointer data)
 {
     DEBUG ("pulse_change_source %s", sourcename);
     if (vol->pa_default_source) g_free (vol->pa_default_source);
     vol->pa_default_source = g_strdup (sourcename);
 
-    if (!pa_set_default_source (vol, sourcename))
-    {
-        DEBUG ("pulse_change_source error");
-        return 0;
-    }
-
-    DEBUG ("pulse_change_source done");
-    return 1;
+    return pa_set_default_source (vol, sourcename, cb, data);
 }
 
 /* Call the PulseAudio set default source operation */
 
-static int pa_set_default_source (VolumePulsePlugin *vol, const char *sourcename)
+static int pa_set_default_source (VolumePulsePlugin *vol, const char *sourcename, PulseCallback cb, gpointer data)
 {
     DEBUG ("pa_set_default_source %s", sourcename);
-    START_PA_OPERATION
-    op = pa_context_set_default_source (vol->pa_cont, sourcename, &pa_cb_generic_success, vol);
+    START_PA_OPERATION (NULL, cb, data)
+    op = pa_context_set_default_source (vol->pa_cont, sourcename, &pa_cb_generic_success, paop);
     END_PA_OPERATION ("set_default_source")
 }
 
@@ -645,55 +1658,60 @@ static int pa_set_default_source (VolumePulsePlugin *vol, const char *sourcename
 void pulse_move_input_streams (VolumePulsePlugin *vol)
 {
     DEBUG ("pulse_move_input_streams");
-    vol->pa_indices = NULL;
-    pa_get_input_streams (vol);
-    g_list_foreach (vol->pa_indices, pa_list_move_to_default_source, vol);
-    g_list_free (vol->pa_indices);
-    DEBUG ("pulse_move_input_streams done");
+    pa_get_input_streams (vol, pa_done_move_input_streams);
 }
 
-/* Query the controller for a list of current output streams */
+/* Query the controller for a list of current input streams */
 
-static int pa_get_input_streams (VolumePulsePlugin *vol)
+static int pa_get_input_streams (VolumePulsePlugin *vol, PulseOpDone done)
 {
     DEBUG ("pa_get_input_streams");
-    START_PA_OPERATION
-    op = pa_context_get_source_output_info_list (vol->pa_cont, &pa_cb_get_input_streams, vol);
-    END_PA_OPERATION ("get_sink_input_info_list")
+    START_PA_OPERATION (done, NULL, NULL)
+    paop->free_result = g_free;
+    op = pa_context_get_source_output_info_list (vol->pa_cont, &pa_cb_get_input_streams, paop);
+    END_PA_OPERATION ("get_source_output_info_list")
 }
 
 /* Callback for input stream query */
 
-static void pa_cb_get_input_streams (pa_context *, const pa_source_output_info *i, int eol, void *userdata)
+static void pa_cb_get_input_streams (pa_context *context, const pa_source_output_info *i, int eol, void *userdata)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    PulseOp *paop = (PulseOp *) userdata;
 
     if (!eol)
     {
+        PulseStream *stream = g_new0 (PulseStream, 1);
         DEBUG ("pa_cb_get_input_streams %d", i->index);
-        vol->pa_indices = g_list_append (vol->pa_indices, (void *) ((uintptr_t) i->index));
+        stream->index = i->index;
+        stream->device = i->source;
+        stream->mute = i->mute;
+        paop->results = g_list_append (paop->results, stream);
+        return;
     }
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    if (eol < 0) paop->error_msg = g_strdup (pa_strerror (pa_context_errno (context)));
+    pa_op_complete (paop);
 }
 
-/* Callback for per-stream operation by looping through pa_indices, moving stream for each */
+/* Completion for input stream query - moves each listed stream not already on the default source in a single batch */
 
-static void pa_list_move_to_default_source (gpointer data, gpointer userdata)
+static void pa_done_move_input_streams (PulseOp *paop)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    VolumePulsePlugin *vol = paop->vol;
+    PulseDevice *dev = pa_find_device (vol->pa_sources, vol->pa_default_source);
 
-    pa_move_stream_to_default_source (vol, (uintptr_t) data);
+    if (!vol->pa_default_source) return;
+    pa_run_batch (vol, pa_select_streams (paop->results, pa_stream_not_on_device, dev ? dev->index : PA_INVALID_INDEX),
+        pa_move_stream_to_default_source, "move_source_output_by_name");
+    DEBUG ("pulse_move_input_streams done");
 }
 
-/* Call the PulseAudio move stream operation for the supplied index to move the stream to the default source */
+/* Submit the PulseAudio move stream operation for the supplied index to move the stream to the default source - called in a batch */
 
-static int pa_move_stream_to_default_source (VolumePulsePlugin *vol, int index)
+static pa_operation *pa_move_stream_to_default_source (VolumePulsePlugin *vol, uint32_t index, PulseOp *paop)
 {
     DEBUG ("pa_move_stream_to_default_source %s %d", vol->pa_default_source, index);
-    START_PA_OPERATION
-    op = pa_context_move_source_output_by_name (vol->pa_cont, index, vol->pa_default_source, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("move_source_output_by_name")
+    return pa_context_move_source_output_by_name (vol->pa_cont, index, vol->pa_default_source, &pa_cb_batch_success, paop);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -703,109 +1721,97 @@ static int pa_move_stream_to_default_source (VolumePulsePlugin *vol, int index)
 void pulse_mute_all_streams (VolumePulsePlugin *vol)
 {
     DEBUG ("pulse_mute_all_streams");
-
-    vol->pa_indices = NULL;
-    pa_get_output_streams (vol);
-    g_list_foreach (vol->pa_indices, pa_list_mute_stream, vol);
-    g_list_free (vol->pa_indices);
-    DEBUG ("pulse_mute_all_streams done");
+    pa_get_output_streams (vol, pa_done_mute_all_streams);
 }
 
-/* Callback for per-stream operation by looping through pa_indices, muting stream for each */
+/* Completion for output stream query - mutes each listed stream which is not already muted */
 
-static void pa_list_mute_stream (gpointer data, gpointer userdata)
+static void pa_done_mute_all_streams (PulseOp *paop)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    pa_mute_stream (vol, (uintptr_t) data);
+    pa_run_batch (paop->vol, pa_select_streams (paop->results, pa_stream_unmuted, 0), pa_mute_stream, "set_sink_input_mute");
+    DEBUG ("pulse_mute_all_streams done");
 }
 
-/* Call the PulseAudio mute stream operation for the supplied index*/
+/* Submit the PulseAudio mute stream operation for the supplied index - called in a batch */
 
-static int pa_mute_stream (VolumePulsePlugin *vol, int index)
+static pa_operation *pa_mute_stream (VolumePulsePlugin *vol, uint32_t index, PulseOp *paop)
 {
     DEBUG ("pa_mute_stream %d", index);
-    START_PA_OPERATION
-    op = pa_context_set_sink_input_mute (vol->pa_cont, index, 1, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("set_sink_input_mute")
+    return pa_context_set_sink_input_mute (vol->pa_cont, index, 1, &pa_cb_batch_success, paop);
 }
 
 void pulse_unmute_all_streams (VolumePulsePlugin *vol)
 {
     DEBUG ("pulse_unmute_all_streams");
+    pa_get_output_streams (vol, pa_done_unmute_all_streams);
+}
 
-    vol->pa_indices = NULL;
-    pa_get_output_streams (vol);
-    g_list_foreach (vol->pa_indices, pa_list_unmute_stream, vol);
-    g_list_free (vol->pa_indices);
+/* Completion for output stream query - unmutes each listed stream which is muted */
+
+static void pa_done_unmute_all_streams (PulseOp *paop)
+{
+    pa_run_batch (paop->vol, pa_select_streams (paop->results, pa_stream_muted, 0), pa_unmute_stream, "set_sink_input_mute");
     DEBUG ("pulse_unmute_all_streams done");
 }
 
-/* Callback for per-stream operation by looping through pa_indices, unmuting stream for each */
+/* Submit the PulseAudio unmute stream operation for the supplied index - called in a batch */
 
-static void pa_list_unmute_stream (gpointer data, gpointer userdata)
+static pa_operation *pa_unmute_stream (VolumePulsePlugin *vol, uint32_t index, PulseOp *paop)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    pa_unmute_stream (vol, (uintptr_t) data);
+    DEBUG ("pa_unmute_stream %d", index);
+    return pa_context_set_sink_input_mute (vol->pa_cont, index, 0, &pa_cb_batch_success, paop);
 }
 
-/* Call the PulseAudio unmute stream operation for the supplied index*/
+/* Make a list of the indices of the streams which need an operation */
 
-static int pa_unmute_stream (VolumePulsePlugin *vol, int index)
+static GList *pa_select_streams (GList *streams, gboolean (*select) (PulseStream *stream, uint32_t device), uint32_t device)
 {
-    DEBUG ("pa_unmute_stream %d", index);
-    START_PA_OPERATION
-    op = pa_context_set_sink_input_mute (vol->pa_cont, index, 0, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("set_sink_input_mute")
+    GList *l, *indices = NULL;
+
+    for (l = streams; l != NULL; l = l->next)
+        if (select ((PulseStream *) l->data, device))
+            indices = g_list_prepend (indices, GUINT_TO_POINTER (((PulseStream *) l->data)->index));
+    return g_list_reverse (indices);
 }
 
-/*----------------------------------------------------------------------------*/
-/* Profiles                                                                   */
-/*----------------------------------------------------------------------------*/
+/* Selection functions for streams */
 
-/* 
- * Read the profile of the supplied card - this is polled to check if a Bluetooth device has
- * successfully connected to PulseAudio, hence why the profile is NULLed before starting so
- * that old profile data does not spuriously cause the poll to succeed prematurely.
- */ 
+static gboolean pa_stream_not_on_device (PulseStream *stream, uint32_t device)
+{
+    return stream->device != device;
+}
 
-int pulse_get_profile (VolumePulsePlugin *vol, const char *card)
+static gboolean pa_stream_unmuted (PulseStream *stream, uint32_t)
 {
-    if (vol->pa_profile)
-    {
-        g_free (vol->pa_profile);
-        vol->pa_profile = NULL;
-    }
+    return !stream->mute;
+}
 
-    START_PA_OPERATION
-    op = pa_context_get_card_info_by_name (vol->pa_cont, card, &pa_cb_get_profile, vol);
-    END_PA_OPERATION ("get_card_info_by_name")
+static gboolean pa_stream_muted (PulseStream *stream, uint32_t)
+{
+    return stream->mute;
 }
 
-/* Callback for profile query */
+/*----------------------------------------------------------------------------*/
+/* Profiles                                                                   */
+/*----------------------------------------------------------------------------*/
+
+/* Read the profile of the supplied card from the model - returns NULL if the card does not exist */
 
-static void pa_cb_get_profile (pa_context *, const pa_card_info *i, int eol, void *userdata)
+const char *pulse_get_profile (VolumePulsePlugin *vol, const char *card)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    if (!eol)
-    {
-        DEBUG ("pa_cb_get_profile %s", i->active_profile2->name);
-        if (vol->pa_profile) g_free (vol->pa_profile);
-        vol->pa_profile = g_strdup (i->active_profile2->name);
-    }
+    PulseCard *pacard = pa_find_card (vol, card);
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    DEBUG ("pulse_get_profile %s %s", card, pacard ? pacard->active_profile : "none");
+    return pacard ? pacard->active_profile : NULL;
 }
 
 /* Call the PulseAudio set profile operation for the supplied card */
 
-int pulse_set_profile (VolumePulsePlugin *vol, const char *card, const char *profile)
+int pulse_set_profile (VolumePulsePlugin *vol, const char *card, const char *profile, PulseCallback cb, gpointer data)
 {
     DEBUG ("pulse_set_profile %s %s", card, profile);
-    START_PA_OPERATION
-    op = pa_context_set_card_profile_by_name (vol->pa_cont, card, profile, &pa_cb_generic_success, vol);
+    START_PA_OPERATION (NULL, cb, data)
+    op = pa_context_set_card_profile_by_name (vol->pa_cont, card, profile, &pa_cb_generic_success, paop);
     END_PA_OPERATION ("set_card_profile_by_name")
 }
 
@@ -814,104 +1820,50 @@ int pulse_set_profile (VolumePulsePlugin *vol, const char *card, const char *pro
 /*----------------------------------------------------------------------------*/
 
 /* 
- * To populate the device select menu, the controller is initially queried for the
+ * To populate the device select menu, the model is initially read for the
  * list of audio cards, which are stored with their card names. After discovery is
- * complete, the controller is queried for the list of sinks and sources, which is
+ * complete, the model is read for the list of sinks and sources, which is
  * used to replace the card name with the relevant sink or source name, allowing
  * cards which are have the wrong profile set to be shown greyed-out in the menu.
+ * Each sink or source finds its menu item with a single lookup in the menu's
+ * index, by ALSA card or BlueZ path; an ALSA item is re-keyed by its sink or
+ * source name when it is renamed. The menu is built on the GTK thread from the plain records in the model, so
+ * it needs no server access and nothing which blocks.
  */
  
 /* Loop through all cards, adding each to relevant part of device menu */
 
-int pulse_add_devices_to_menu (VolumePulsePlugin *vol, gboolean internal, gboolean input_control)
+void pulse_add_devices_to_menu (VolumePulsePlugin *vol, gboolean internal, gboolean input_control)
 {
-    if (internal && input_control) return 0;
+    GHashTableIter iter;
+    gpointer value;
+
+    if (internal && input_control) return;
+    if (!vol->pa_cards || !vol->menu_devices[input_control ? 1 : 0]) return;
     vol->separator = FALSE;
     DEBUG ("pulse_add_devices_to_menu %d %d", input_control, internal);
-    START_PA_OPERATION
-    if (input_control)
-        op = pa_context_get_card_info_list (vol->pa_cont, &pa_cb_get_info_inputs, vol);
-    else if (internal)
-        op = pa_context_get_card_info_list (vol->pa_cont, &pa_cb_get_info_internal, vol);
-    else
-        op = pa_context_get_card_info_list (vol->pa_cont, &pa_cb_get_info_external, vol);
-    END_PA_OPERATION ("get_card_info_list")
-}
-
-/*
- * Callbacks for card info query, each of which checks to see if the device should
- * be in the menu in question and adding it if so
- */
 
-static void pa_cb_get_info_inputs (pa_context *, const pa_card_info *i, int eol, void *userdata)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    if (!eol)
+    g_hash_table_iter_init (&iter, vol->pa_cards);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
     {
-        if (pa_card_has_port (i, PA_DIRECTION_INPUT))
-        {
-            const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
-            const char *dev = pa_proplist_gets (i->proplist, "alsa.card");
-            if (nam)
-            {
-                DEBUG ("pa_cb_get_info_inputs %s", dev);
-                menu_add_item (vol, nam, dev, TRUE);
-            }
-        }
-    }
-
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
-}
-
-static void pa_cb_get_info_internal (pa_context *, const pa_card_info *i, int eol, void *userdata)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+        PulseCard *card = (PulseCard *) value;
+        if (!card->alsa_name) continue;
 
-    if (!eol)
-    {
-        if (!g_strcmp0 (pa_proplist_gets (i->proplist, "device.description"), "Built-in Audio"))
+        if (input_control)
         {
-            if (pa_card_has_port (i, PA_DIRECTION_OUTPUT))
-            {
-                const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
-                const char *dev = pa_proplist_gets (i->proplist, "alsa.card");
-                if (nam)
-                {
-                    if (!strcmp (nam, "bcm2835 Headphones") && vsystem ("raspi-config nonint has_analog")) return;
-                    DEBUG ("pa_cb_get_info_internal %s", dev);
-                    menu_add_item (vol, nam, dev, FALSE);
-                }
-            }
+            if (!card->has_input) continue;
         }
-    }
-
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
-}
-
-static void pa_cb_get_info_external (pa_context *, const pa_card_info *i, int eol, void *userdata)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    if (!eol)
-    {
-        if (g_strcmp0 (pa_proplist_gets (i->proplist, "device.description"), "Built-in Audio"))
+        else
         {
-            if (pa_card_has_port (i, PA_DIRECTION_OUTPUT))
-            {
-                const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
-                const char *dev = pa_proplist_gets (i->proplist, "alsa.card");
-                if (nam)
-                {
-                    DEBUG ("pa_cb_get_info_external %s", dev);
-                    menu_add_separator (vol, vol->menu_devices[0]);
-                    menu_add_item (vol, nam, dev, FALSE);
-                }
-            }
+            if (!card->has_output) continue;
+            if (internal != !g_strcmp0 (card->description, "Built-in Audio")) continue;
+            if (internal && !strcmp (card->alsa_name, "bcm2835 Headphones") && vol->analog_disabled) continue;
+            if (!internal) menu_add_separator (vol, vol->menu_devices[0]);
         }
-    }
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+        DEBUG ("pulse_add_devices_to_menu %s", card->alsa_card);
+        menu_add_item (vol, card->alsa_name, card->alsa_card, input_control);
+    }
 }
 
 /* Function to determine whether or not a card has either input or output ports */
@@ -932,179 +1884,111 @@ static gboolean pa_card_has_port (const pa_card_info *i, pa_direction_t dir)
 
 void pulse_update_devices_in_menu (VolumePulsePlugin *vol, gboolean input_control)
 {
-    if (input_control) pa_replace_cards_with_sources (vol);
-    else pa_replace_cards_with_sinks (vol);
-}
-
-/* Query controller for list of sinks */
-
-static int pa_replace_cards_with_sinks (VolumePulsePlugin *vol)
-{
-    DEBUG ("pa_replace_cards_with_sinks");
-    START_PA_OPERATION
-    op = pa_context_get_sink_info_list (vol->pa_cont, &pa_cb_replace_cards_with_sinks, vol);
-    END_PA_OPERATION ("get_sink_info_list")
-}
-
-/* Callback for sink list query, which updates ALSA devices in menu as appropriate */
-
-static void pa_cb_replace_cards_with_sinks (pa_context *, const pa_sink_info *i, int eol, void *userdata)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    if (!eol && vol->menu_devices[0])
+    GHashTableIter iter;
+    gpointer value;
+    GtkWidget *mi;
+    GList *devices = NULL, *l;
+    GHashTable *table = input_control ? vol->pa_sources : vol->pa_sinks;
+
+    DEBUG ("pulse_update_devices_in_menu %d", input_control);
+    if (!table || !vol->menu_devices[input_control ? 1 : 0]) return;
+
+    // monitors carry the card of their sink, so are never offered as inputs
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        if (((PulseDevice *) value)->monitor_of_sink == PA_INVALID_INDEX) devices = g_list_prepend (devices, value);
+
+    // once renamed, a card's entry is no longer found by card number, so the lowest index on a card wins
+    devices = g_list_sort (devices, pa_compare_devices);
+    for (l = devices; l != NULL; l = l->next)
     {
-        const char *api = pa_proplist_gets (i->proplist, "device.api");
-        if (!g_strcmp0 (api, "alsa"))
-            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices[0]), pa_replace_card_with_sink_on_match, (void *) i);
+        PulseDevice *dev = (PulseDevice *) l->data;
+        if (!g_strcmp0 (dev->api, "alsa"))
+        {
+            mi = menu_find_item (vol, dev->alsa_card, input_control);
+            if (mi) pa_replace_card_with_device (vol, mi, dev, input_control);
+        }
         else
-            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices[0]), pa_card_check_bt_output_profile, (void *) i);
-    }
-
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
-}
-
-/* Callback for per-menu-item operation which checks to see if each matches the card name and updates with sink data if so */
-
-static void pa_replace_card_with_sink_on_match (GtkWidget *widget, gpointer data)
-{
-    pa_sink_info *i = (pa_sink_info *) data;
-    const char *dev = pa_proplist_gets (i->proplist, "alsa.card");
-
-    if (!strcmp (dev, gtk_widget_get_name (widget)))
-    {
-        gtk_widget_set_name (widget, i->name);
-        gtk_widget_set_sensitive (widget, TRUE);
-        gtk_widget_set_tooltip_text (widget, NULL);
-    }
-}
-
-/* Callback for per-menu-item operation which checks to see if a Bluetooth device is in a profile with an output */
-
-static void pa_card_check_bt_output_profile (GtkWidget *widget, gpointer data)
-{
-    pa_sink_info *i = (pa_sink_info *) data;
-    const char *btpath = pa_proplist_gets (i->proplist, "bluez.path");
-
-    if (!g_strcmp0 (btpath, gtk_widget_get_name (widget)))
-    {
-        const char *profile = pa_proplist_gets (i->proplist, "bluetooth.protocol");
-        if (!g_strcmp0 (profile, "a2dp_sink") || !g_strcmp0 (profile, "headset_head_unit"))
         {
-            gtk_widget_set_sensitive (widget, TRUE);
-            gtk_widget_set_tooltip_text (widget, NULL);
+            mi = menu_find_item (vol, dev->bluez_path, input_control);
+            if (mi) pa_card_check_bt_profile (mi, dev, input_control);
         }
     }
+    g_list_free (devices);
 }
 
-/* Query controller for list of sources */
+/* Compare two sinks or sources by index, which is the order the server lists them in */
 
-static int pa_replace_cards_with_sources (VolumePulsePlugin *vol)
+static gint pa_compare_devices (gconstpointer a, gconstpointer b)
 {
-    DEBUG ("pa_replace_cards_with_sources");
-    START_PA_OPERATION
-    op = pa_context_get_source_info_list (vol->pa_cont, &pa_cb_replace_cards_with_sources, vol);
-    END_PA_OPERATION ("get_source_info_list")
+    uint32_t ia = ((const PulseDevice *) a)->index, ib = ((const PulseDevice *) b)->index;
+
+    return ia < ib ? -1 : (ia > ib ? 1 : 0);
 }
 
-/* Callback for source list query, which updates ALSA devices in menu as appropriate */
+/* Replace the card name of a menu item with the name of the sink or source on that card, and enable it */
 
-static void pa_cb_replace_cards_with_sources (pa_context *, const pa_source_info *i, int eol, void *userdata)
+static void pa_replace_card_with_device (VolumePulsePlugin *vol, GtkWidget *widget, PulseDevice *dev, gboolean input_control)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    if (!eol && vol->menu_devices[1])
-    {
-        const char *api = pa_proplist_gets (i->proplist, "device.api");
-        if (!g_strcmp0 (api, "alsa"))
-            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices[1]), pa_replace_card_with_source_on_match, (void *) i);
-        else
-            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices[1]), pa_card_check_bt_input_profile, (void *) i);
-    }
-
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    menu_rename_item (vol, widget, dev->name, input_control);
+    gtk_widget_set_sensitive (widget, TRUE);
+    gtk_widget_set_tooltip_text (widget, NULL);
 }
 
-/* Callback for per-menu-item operation which checks to see if each matches the card name and updates with source data if so */
+/* Enable the menu item for a Bluetooth device if it is in a profile with an output or input as required */
 
-static void pa_replace_card_with_source_on_match (GtkWidget *widget, gpointer data)
+static void pa_card_check_bt_profile (GtkWidget *widget, PulseDevice *dev, gboolean input_control)
 {
-    pa_source_info *i = (pa_source_info *) data;
-    const char *dev = pa_proplist_gets (i->proplist, "alsa.card");
-
-    if (!strcmp (dev, gtk_widget_get_name (widget)))
+    if (!g_strcmp0 (dev->bt_protocol, "headset_head_unit") || (!input_control && !g_strcmp0 (dev->bt_protocol, "a2dp_sink")))
     {
-        gtk_widget_set_name (widget, i->name);
         gtk_widget_set_sensitive (widget, TRUE);
         gtk_widget_set_tooltip_text (widget, NULL);
     }
 }
 
-/* Callback for per-menu-item operation which checks to see if a Bluetooth device is in a profile with an input */
-
-static void pa_card_check_bt_input_profile (GtkWidget *widget, gpointer data)
-{
-    pa_source_info *i = (pa_source_info *) data;
-    const char *btpath = pa_proplist_gets (i->proplist, "bluez.path");
-
-    if (!g_strcmp0 (btpath, gtk_widget_get_name (widget)))
-    {
-        const char *profile = pa_proplist_gets (i->proplist, "bluetooth.protocol");
-        if (!g_strcmp0 (profile, "headset_head_unit"))
-        {
-            gtk_widget_set_sensitive (widget, TRUE);
-            gtk_widget_set_tooltip_text (widget, NULL);
-        }
-    }
-}
-
 /*----------------------------------------------------------------------------*/
 /* Profiles dialog                                                            */
 /*----------------------------------------------------------------------------*/
 
-/* Query controller for list of cards */
-
-int pulse_add_devices_to_profile_dialog (VolumePulsePlugin *vol)
-{
-    DEBUG ("pulse_add_devices_to_profile_dialog");
-    START_PA_OPERATION
-    op = pa_context_get_card_info_list (vol->pa_cont, &pa_cb_add_devices_to_profile_dialog, vol);
-    END_PA_OPERATION ("get_card_info_list")
-}
-
-/* Callback for card list query - reads profiles for card and adds as a combo box to profiles dialog */
+/* Loop through all cards, adding profiles for each as a combo box to profiles dialog */
 
-static void pa_cb_add_devices_to_profile_dialog (pa_context *, const pa_card_info *i, int eol, void *userdata)
+void pulse_add_devices_to_profile_dialog (VolumePulsePlugin *vol)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
+    GHashTableIter iter;
+    gpointer value;
     GtkListStore *ls;
-    int index = 0, sel = -1;
+    GList *p;
+    int index, sel;
 
-    if (!eol)
+    DEBUG ("pulse_add_devices_to_profile_dialog");
+    if (!vol->pa_cards) return;
+
+    g_hash_table_iter_init (&iter, vol->pa_cards);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
     {
+        PulseCard *card = (PulseCard *) value;
+
         // loop through profiles, adding each to list store
         ls = gtk_list_store_new (2, G_TYPE_STRING, G_TYPE_STRING);
-        pa_card_profile_info2 **profile = i->profiles2;
-        while (*profile)
+        index = 0;
+        sel = -1;
+        for (p = card->profiles; p != NULL; p = p->next)
         {
-            if (*profile == i->active_profile2) sel = index;
-            gtk_list_store_insert_with_values (ls, NULL, index++, 0, (*profile)->name, 1, (*profile)->description, -1);
-            profile++;
+            PulseProfile *prof = (PulseProfile *) p->data;
+            if (!g_strcmp0 (prof->name, card->active_profile)) sel = index;
+            gtk_list_store_insert_with_values (ls, NULL, index++, 0, prof->name, 1, prof->description, -1);
         }
 
-        if (!g_strcmp0 (pa_proplist_gets (i->proplist, "device.api"), vol->pipewire ? "bluez5" : "bluez"))
-            profiles_dialog_add_combo (vol, ls, vol->profiles_bt_box, sel, pa_proplist_gets (i->proplist, "device.description"), i->name);
+        if (!g_strcmp0 (card->api, vol->pipewire ? "bluez5" : "bluez"))
+            profiles_dialog_add_combo (vol, ls, vol->profiles_bt_box, sel, card->description, card->name);
         else
         {
-            if (g_strcmp0 (pa_proplist_gets (i->proplist, "device.form_factor"), "internal"))
-                profiles_dialog_add_combo (vol, ls, vol->profiles_ext_box, sel, pa_proplist_gets (i->proplist, "alsa.card_name"), i->name);
-            else if (pa_card_has_port (i, PA_DIRECTION_OUTPUT))
-                profiles_dialog_add_combo (vol, ls, vol->profiles_int_box, sel, pa_proplist_gets (i->proplist, "alsa.card_name"), i->name);
+            if (g_strcmp0 (card->form_factor, "internal"))
+                profiles_dialog_add_combo (vol, ls, vol->profiles_ext_box, sel, card->alsa_name, card->name);
+            else if (card->has_output)
+                profiles_dialog_add_combo (vol, ls, vol->profiles_int_box, sel, card->alsa_name, card->name);
         }
     }
-
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -1115,50 +1999,56 @@ static void pa_cb_add_devices_to_profile_dialog (pa_context *, const pa_card_inf
 
 int pulse_count_devices (VolumePulsePlugin *vol, gboolean input_control)
 {
-    vol->pa_devices = 0;
-    START_PA_OPERATION
-    if (input_control)
-        op = pa_context_get_card_info_list (vol->pa_cont, &pa_cb_count_inputs, vol);
-    else
-        op = pa_context_get_card_info_list (vol->pa_cont, &pa_cb_count_outputs, vol);
-    END_PA_OPERATION ("get_card_info_list")
+    return vol->pa_count[input_control ? 1 : 0];
 }
 
-/*
- * Callbacks for card count query, each of which just increments the global device counter
- * whenever a matching device is found
- */
+/* Get the name of the card for a BlueZ device - returns NULL if the card is not in the model */
 
-static void pa_cb_count_inputs (pa_context *, const pa_card_info *i, int eol, void *userdata)
+const char *pulse_get_bluez_card (VolumePulsePlugin *vol, const char *path)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    PulseBluez *entry = pa_find_bluez (vol, path);
+    PulseCard *card;
 
-    if (!eol)
-    {
-        if (pa_card_has_port (i, PA_DIRECTION_INPUT))
-        {
-            const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
-            if (nam) vol->pa_devices++;
-        }
-    }
+    if (!entry || entry->card == PA_INVALID_INDEX) return NULL;
+    card = g_hash_table_lookup (vol->pa_cards, GUINT_TO_POINTER (entry->card));
+    return card ? card->name : NULL;
+}
+
+/* Get the active profile of the card for a BlueZ device - returns NULL if the card is not in the model */
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+const char *pulse_get_bluez_profile (VolumePulsePlugin *vol, const char *path)
+{
+    PulseBluez *entry = pa_find_bluez (vol, path);
+    PulseCard *card;
+
+    if (!entry || entry->card == PA_INVALID_INDEX) return NULL;
+    card = g_hash_table_lookup (vol->pa_cards, GUINT_TO_POINTER (entry->card));
+    return card ? card->active_profile : NULL;
 }
 
-static void pa_cb_count_outputs (pa_context *, const pa_card_info *i, int eol, void *userdata)
+/* Get the name of the sink or source for a BlueZ device - returns NULL if it is not in the model */
+
+const char *pulse_get_bluez_device (VolumePulsePlugin *vol, const char *path, gboolean input_control)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    PulseBluez *entry = pa_find_bluez (vol, path);
+    PulseDevice *dev;
+    uint32_t index;
+
+    if (!entry) return NULL;
+    index = entry->device[input_control ? 1 : 0];
+    if (index == PA_INVALID_INDEX) return NULL;
+    dev = g_hash_table_lookup (input_control ? vol->pa_sources : vol->pa_sinks, GUINT_TO_POINTER (index));
+    return dev ? dev->name : NULL;
+}
 
-    if (!eol)
-    {
-        if (pa_card_has_port (i, PA_DIRECTION_OUTPUT))
-        {
-            const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
-            if (nam) vol->pa_devices++;
-        }
-    }
+/* Get the BlueZ object path of the default sink or source, if it is a Bluetooth device */
+
+const char *pulse_get_default_bluez_path (VolumePulsePlugin *vol, gboolean input_control)
+{
+    PulseDevice *dev = pa_default_device (vol, input_control);
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    if (!dev || strstr (dev->name, "monitor")) return NULL;
+    return dev->bluez_path;
 }
 
 /* End of file */
@@ -38,9 +38,8 @@ extern int pulse_set_volume (VolumePulsePlugin *vol, int volume, gboolean input_
 extern int pulse_get_mute (VolumePulsePlugin *vol, gboolean input_control);
 extern int pulse_set_mute (VolumePulsePlugin *vol, int mute, gboolean input_control);
 
-extern int pulse_get_default_sink_source (VolumePulsePlugin *vol);
-extern int pulse_change_sink (VolumePulsePlugin *vol, const char *sinkname);
-extern int pulse_change_source (VolumePulsePlugin *vol, const char *sourcename);
+extern int pulse_change_sink (VolumePulsePlugin *vol, const char *sinkname, PulseCallback cb, gpointer data);
+extern int pulse_change_source (VolumePulsePlugin *vol, const char *sourcename, PulseCallback cb, gpointer data);
 
 extern void pulse_mute_all_streams (VolumePulsePlugin *vol);
 extern void pulse_unmute_all_streams (VolumePulsePlugin *vol);
@@ -48,14 +47,18 @@ extern void pulse_unmute_all_streams (VolumePulsePlugin *vol);
 extern void pulse_move_input_streams (VolumePulsePlugin *vol);
 extern void pulse_move_output_streams (VolumePulsePlugin *vol);
 
-extern int pulse_get_profile (VolumePulsePlugin *vol, const char *card);
-extern int pulse_set_profile (VolumePulsePlugin *vol, const char *card, const char *profile);
+extern const char *pulse_get_profile (VolumePulsePlugin *vol, const char *card);
+extern int pulse_set_profile (VolumePulsePlugin *vol, const char *card, const char *profile, PulseCallback cb, gpointer data);
 
-extern int pulse_add_devices_to_menu (VolumePulsePlugin *vol, gboolean internal, gboolean input_control);
+extern void pulse_add_devices_to_menu (VolumePulsePlugin *vol, gboolean internal, gboolean input_control);
 extern void pulse_update_devices_in_menu (VolumePulsePlugin *vol, gboolean input_control);
-extern int pulse_add_devices_to_profile_dialog (VolumePulsePlugin *vol);
+extern void pulse_add_devices_to_profile_dialog (VolumePulsePlugin *vol);
 
 extern int pulse_count_devices (VolumePulsePlugin *vol, gboolean input_control);
+extern const char *pulse_get_bluez_card (VolumePulsePlugin *vol, const char *path);
+extern const char *pulse_get_bluez_profile (VolumePulsePlugin *vol, const char *path);
+extern const char *pulse_get_bluez_device (VolumePulsePlugin *vol, const char *path, gboolean input_control);
+extern const char *pulse_get_default_bluez_path (VolumePulsePlugin *vol, gboolean input_control);
 
 /* End of file */
 /*----------------------------------------------------------------------------*/
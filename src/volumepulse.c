@@ -214,6 +214,7 @@ static void mic_gesture_end (GtkGestureLongPress *, GdkEventSequence *, gpointer
 /* Handler for system config changed message from panel */
 void volumepulse_update_display (VolumePulsePlugin *vol)
 {
+    invalidate_display (vol);
     update_display (vol, FALSE);
     update_display (vol, TRUE);
 }
@@ -321,12 +322,17 @@ void volumepulse_init (VolumePulsePlugin *vol)
     /* Set up variables */
     vol->menu_devices[0] = NULL;
     vol->menu_devices[1] = NULL;
+    vol->menu_items[0] = NULL;
+    vol->menu_items[1] = NULL;
     vol->popup_window[0] = NULL;
     vol->popup_window[1] = NULL;
+    vol->popup_box[0] = NULL;
+    vol->popup_box[1] = NULL;
     vol->profiles_dialog = NULL;
     vol->conn_dialog = NULL;
     vol->hdmi_names[0] = NULL;
     vol->hdmi_names[1] = NULL;
+    invalidate_display (vol);
 
     vol->pipewire = !system ("ps ax | grep pipewire-pulse | grep -qv grep");
     if (vol->pipewire)
@@ -371,10 +377,16 @@ void volumepulse_destructor (gpointer user_data)
 #else
     close_popup ();
 #endif
+    popup_window_free (vol);
 
     bluetooth_terminate (vol);
     pulse_terminate (vol);
 
+    if (vol->icon_atlas) g_hash_table_destroy (vol->icon_atlas);
+    if (vol->menu_items[0]) g_hash_table_destroy (vol->menu_items[0]);
+    if (vol->menu_items[1]) g_hash_table_destroy (vol->menu_items[1]);
+    if (vol->profiles_pending) g_hash_table_destroy (vol->profiles_pending);
+
 #ifndef LXPLUG
     if (vol->gesture[0]) g_object_unref (vol->gesture[0]);
     if (vol->gesture[1]) g_object_unref (vol->gesture[1]);
@@ -36,7 +36,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define DEBUG(fmt,args...)
 #endif
 
-typedef struct 
+typedef struct _VolumePulsePlugin VolumePulsePlugin;
+
+/* Completion callback for asynchronous PulseAudio operations - called on the GTK thread */
+
+typedef void (*PulseCallback) (VolumePulsePlugin *vol, gboolean success, gpointer data);
+
+struct _VolumePulsePlugin
 {
     GtkWidget *plugin[2];
 
@@ -57,22 +63,37 @@ typedef struct
     /* graphics */
     GtkWidget *tray_icon[2];            /* Displayed icon */
     GtkWidget *popup_window[2];         /* Top level window for popup */
+    GtkWidget *popup_box[2];            /* Box of popup controls, kept between openings */
     GtkWidget *popup_volume_scale[2];   /* Scale for volume */
     GtkWidget *popup_mute_check[2];     /* Checkbox for mute state */
     GtkWidget *menu_devices[2];         /* Right-click menu */
+    gboolean menu_stale[2];             /* Devices have changed since the menu was built */
+    GHashTable *menu_items[2];          /* Device entries in the menu, keyed by ALSA card, BlueZ path or sink/source name */
+    GtkWidget *menu_default[2];         /* Device entry in the menu ticked as the default */
+    guint menu_prefetch_idle;           /* Idle source which builds the menus after startup */
+    int menu_prefetch_step;             /* Number of menus considered by the prefetch so far */
     GtkWidget *profiles_dialog;         /* Device profiles dialog */
     GtkWidget *profiles_int_box;        /* Vbox for profile combos */
     GtkWidget *profiles_ext_box;        /* Vbox for profile combos */
     GtkWidget *profiles_bt_box;         /* Vbox for profile combos */
+    GPtrArray *profiles_rows;           /* Rows created for the profiles dialog, not yet packed */
+    guint profiles_idle;                /* Idle source which adds the devices to the profiles dialog */
+    GHashTable *profiles_pending;       /* Profiles being set from the dialog, keyed by card name */
     GtkWidget *conn_dialog;             /* Connection dialog box */
     GtkWidget *conn_label;              /* Dialog box text field */
     GtkWidget *conn_ok;                 /* Dialog box button */
     guint volume_scale_handler[2];      /* Handler for volume_scale widget */
     guint mute_check_handler[2];        /* Handler for mute_check widget */
     gboolean separator;                 /* Flag to show whether a menu separator has been added */
+    GList *menu_section;                /* Device entries created for the menu section being built */
+    const char *icon_shown[2];          /* Name of icon currently shown - NULL if not known */
+    int visible_shown[2];               /* Visibility currently shown - -1 if not known */
+    int tooltip_shown[2];               /* Level currently shown in tooltip - -1 if not known */
+    GHashTable *icon_atlas;             /* Rendered taskbar icons at the current size and theme, keyed by icon name */
 
     /* HDMI devices */
     char *hdmi_names[2];                /* Display names of HDMI devices */
+    gboolean analog_disabled;           /* Analog output disabled in raspi-config */
 
     /* PulseAudio interface */
     pa_threaded_mainloop *pa_mainloop;  /* Controller loop variable */
@@ -80,25 +101,30 @@ typedef struct
     pa_context_state_t pa_state;        /* Current controller state */
     char *pa_default_sink;              /* Current default sink name */
     char *pa_default_source;            /* Current default source name */
-    char *pa_profile;                   /* Current profile for card */
-    int pa_channels;                    /* Number of channels on default sink */
-    int pa_volume;                      /* Volume setting on default sink */
-    int pa_mute;                        /* Mute setting on default sink */
-    GList *pa_indices;                  /* Indices for current streams */
-    char *pa_error_msg;                 /* Error message from success / fail callback */
-    int pa_devices;                     /* Counter for pulse devices */
-    guint pa_idle_timer;
+    GHashTable *pa_cards;               /* Local model of cards, keyed by index */
+    GHashTable *pa_sinks;               /* Local model of sinks, keyed by index */
+    GHashTable *pa_sources;             /* Local model of sources, keyed by index */
+    GHashTable *pa_bluez;               /* Bluetooth cards, sinks and sources in the model, keyed by BlueZ object path */
+    char *pa_error_msg;                 /* Error message from last completed operation */
+    guint pa_idle_timer;                /* Idle source which updates the model after notifications */
+    guint pa_dirty;                     /* Flags showing what needs updating after notifications */
+    GHashTable *pa_card_changes;        /* Cards changed or removed since the last update, keyed by index */
+    GHashTable *pa_sink_changes;        /* Sinks changed or removed since the last update, keyed by index */
+    GHashTable *pa_source_changes;      /* Sources changed or removed since the last update, keyed by index */
+    GHashTable *pa_volume_writes;       /* Volume writes in progress, keyed by sink or source name */
+    int pa_count[2];                    /* Number of output and input cards in the model */
+    GList *pa_ops;                      /* Operations submitted and not yet completed */
+    void *pa_connect_op;                /* Operation completed when context connects */
 
     /* Bluetooth interface */
     GDBusObjectManager *bt_objmanager;  /* D-Bus BlueZ object manager */
     guint bt_watcher_id;                /* D-Bus BlueZ watcher ID */
-    char *bt_conname;                   /* Name of device being connected */
-    gboolean bt_input;                  /* Flag to show if current connect operation is for input or output */
     gboolean bt_force_hsp;              /* Flag to override automatic profile selection */
-    int bt_retry_count;                 /* Counter for polling read of profile on connection */
-    guint bt_retry_timer;               /* Timer for retrying post-connection events */
-    gboolean bt_card_found;
-} VolumePulsePlugin;
+    GList *bt_conns;                    /* Connections to BlueZ devices in progress */
+    guint bt_conn_serial;               /* Serial number of the last connection started */
+    GHashTable *bt_devices;             /* Every BlueZ device with its audio services and the directions it counts in, keyed by object path */
+    int bt_count[2];                    /* Number of usable output and input BlueZ devices */
+};
 
 /*----------------------------------------------------------------------------*/
 /* Prototypes                                                                 */